@@ -0,0 +1,499 @@
+#include "batch.h"
+
+// Compile the vector kernels for AVX2 as well as for the baseline instruction set,
+// the best version is selected when the program starts.
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__linux__)
+#define BATCH_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define BATCH_TARGETS
+#endif
+
+// Select a where the mask is set and b elsewhere.
+static inline byte select(byte mask, byte a, byte b) { return (a & mask) | (b & ~mask); }
+static inline word select(word mask, word a, word b) { return (a & mask) | (b & ~mask); }
+
+// Whether op can be executed for a group of lanes at once, and whether the lanes
+// still share the same program counter afterwards.
+static bool is_vector_op(byte op);
+static bool is_straight_op(byte op);
+
+// The V registers an operation which is not vectorized may read or write.
+static word used_registers(const Operation& op);
+
+// Execute op in the lanes of the mask. VF may alias VX or VY, so VX and VY are
+// read again after VF is written, like the interpreter does.
+BATCH_TARGETS
+static void exec_vector(const Operation& op, int n, byte** V, word* I, word* pc,
+        byte* delay, const byte* mask, const word* wide) {
+    byte* vx = V[op.x];
+    byte* vy = V[op.y];
+    byte* vf = V[0xF];
+    byte nn = op.nn;
+    word nnn = op.nnn;
+
+    switch (op.op) {
+        case OP_NOP:
+            break;
+        case OP_JUMP:
+            for (int i = 0; i < n; i++) { pc[i] = select(wide[i], nnn, pc[i]); }
+            return;
+        case OP_SKIP_EQ_CONST:
+            for (int i = 0; i < n; i++) { pc[i] += wide[i] & (vx[i] == nn ? 4 : 2); }
+            return;
+        case OP_SKIP_NEQ_CONST:
+            for (int i = 0; i < n; i++) { pc[i] += wide[i] & (vx[i] != nn ? 4 : 2); }
+            return;
+        case OP_SKIP_EQ:
+            for (int i = 0; i < n; i++) {
+                pc[i] += wide[i] & (vx[i] == vy[i] && op.n == 0 ? 4 : 2);
+            }
+            return;
+        case OP_SKIP_NEQ:
+            for (int i = 0; i < n; i++) {
+                pc[i] += wide[i] & (vx[i] != vy[i] && op.n == 0 ? 4 : 2);
+            }
+            return;
+        case OP_ASSIGN_CONST:
+            for (int i = 0; i < n; i++) { vx[i] = select(mask[i], nn, vx[i]); }
+            break;
+        case OP_ADD_CONST:
+            for (int i = 0; i < n; i++) { vx[i] = select(mask[i], (byte) (vx[i] + nn), vx[i]); }
+            break;
+        case OP_ASSIGN:
+            for (int i = 0; i < n; i++) { vx[i] = select(mask[i], vy[i], vx[i]); }
+            break;
+        case OP_BITWISE_OR:
+            for (int i = 0; i < n; i++) { vx[i] = select(mask[i], (byte) (vx[i] | vy[i]), vx[i]); }
+            break;
+        case OP_BITWISE_AND:
+            for (int i = 0; i < n; i++) { vx[i] = select(mask[i], (byte) (vx[i] & vy[i]), vx[i]); }
+            break;
+        case OP_BITWISE_XOR:
+            for (int i = 0; i < n; i++) { vx[i] = select(mask[i], (byte) (vx[i] ^ vy[i]), vx[i]); }
+            break;
+        case OP_ADD:
+            for (int i = 0; i < n; i++) {
+                vf[i] = select(mask[i], (byte) (vx[i] + vy[i] > 0xFF), vf[i]);
+                vx[i] = select(mask[i], (byte) (vx[i] + vy[i]), vx[i]);
+            }
+            break;
+        case OP_SUB:
+            for (int i = 0; i < n; i++) {
+                vf[i] = select(mask[i], (byte) (vx[i] >= vy[i]), vf[i]);
+                vx[i] = select(mask[i], (byte) (vx[i] - vy[i]), vx[i]);
+            }
+            break;
+        case OP_SHIFT_RIGHT:
+            for (int i = 0; i < n; i++) {
+                vf[i] = select(mask[i], (byte) (vx[i] & 0x1), vf[i]);
+                vx[i] = select(mask[i], (byte) (vx[i] >> 1), vx[i]);
+            }
+            break;
+        case OP_SUB_REVERSE:
+            for (int i = 0; i < n; i++) {
+                vf[i] = select(mask[i], (byte) (vy[i] >= vx[i]), vf[i]);
+                vx[i] = select(mask[i], (byte) (vy[i] - vx[i]), vx[i]);
+            }
+            break;
+        case OP_SHIFT_LEFT:
+            for (int i = 0; i < n; i++) {
+                vf[i] = select(mask[i], (byte) (vx[i] >> 7), vf[i]);
+                vx[i] = select(mask[i], (byte) (vx[i] << 1), vx[i]);
+            }
+            break;
+        case OP_SET_INDEX:
+            for (int i = 0; i < n; i++) { I[i] = select(wide[i], nnn, I[i]); }
+            break;
+        case OP_JUMP_OFFSET:
+            for (int i = 0; i < n; i++) { pc[i] = select(wide[i], (word) (V[0][i] + nnn), pc[i]); }
+            return;
+        case OP_GET_DELAY:
+            for (int i = 0; i < n; i++) { vx[i] = select(mask[i], delay[i], vx[i]); }
+            break;
+        case OP_SET_DELAY:
+            for (int i = 0; i < n; i++) { delay[i] = select(mask[i], vx[i], delay[i]); }
+            break;
+        case OP_ADD_INDEX:
+            for (int i = 0; i < n; i++) { I[i] = select(wide[i], (word) (I[i] + vx[i]), I[i]); }
+            break;
+        case OP_SPRITE_ADDR:
+            for (int i = 0; i < n; i++) { I[i] = select(wide[i], (word) (5 * vx[i]), I[i]); }
+            break;
+    }
+
+    // Advance to the next operation.
+    for (int i = 0; i < n; i++) { pc[i] += wide[i] & 2; }
+}
+
+static bool is_vector_op(byte op) {
+    switch (op) {
+        case OP_SKIP_EQ_CONST: case OP_SKIP_NEQ_CONST: case OP_SKIP_EQ:
+        case OP_SKIP_NEQ: case OP_JUMP_OFFSET:
+            return true;
+        default:
+            return is_straight_op(op);
+    }
+}
+
+static bool is_straight_op(byte op) {
+    switch (op) {
+        case OP_NOP: case OP_JUMP: case OP_ASSIGN_CONST: case OP_ADD_CONST:
+        case OP_ASSIGN: case OP_BITWISE_OR: case OP_BITWISE_AND: case OP_BITWISE_XOR:
+        case OP_ADD: case OP_SUB: case OP_SHIFT_RIGHT: case OP_SUB_REVERSE:
+        case OP_SHIFT_LEFT: case OP_SET_INDEX: case OP_GET_DELAY: case OP_SET_DELAY:
+        case OP_ADD_INDEX: case OP_SPRITE_ADDR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static word used_registers(const Operation& op) {
+    switch (op.op) {
+        case OP_REG_DUMP: case OP_REG_LOAD:
+            return (2 << op.x) - 1;
+        default:
+            return 1 << op.x | 1 << op.y | 1 << 0xF;
+    }
+}
+
+Chip8Batch::Chip8Batch(int num_lanes) : num_lanes_(num_lanes) {
+    for (int i = 0; i < num_lanes_; i++) {
+        lanes_.push_back(new Chip8());
+    }
+    V_.resize(REG_SIZE * num_lanes_);
+    I_.resize(num_lanes_);
+    pc_.resize(num_lanes_);
+    delay_timer_.resize(num_lanes_);
+    cycles_left_.resize(num_lanes_);
+    mask_.resize(num_lanes_);
+    wide_mask_.resize(num_lanes_);
+    done_.resize(num_lanes_);
+    initialize();
+}
+
+Chip8Batch::~Chip8Batch() {
+    for (int i = 0; i < num_lanes_; i++) {
+        delete lanes_[i];
+    }
+}
+
+int Chip8Batch::get_num_lanes() { return num_lanes_; }
+
+// Reset every lane. The lanes are forks of the first one, so they share memory.
+void Chip8Batch::initialize() {
+    lanes_[0]->initialize();
+    fork_lanes();
+}
+
+// Load the ROM into the first lane, which is then forked into the others. Like
+// initialize() this resets the other lanes to the state of the first one.
+void Chip8Batch::load_rom(char* data, int num_bytes) {
+    sync_in(0);
+    lanes_[0]->load_rom(data, num_bytes);
+    fork_lanes();
+}
+
+// Replace the other lanes by forks of the first lane, keeping their seeds.
+void Chip8Batch::fork_lanes() {
+    for (int i = 1; i < num_lanes_; i++) {
+        uint64_t random_state = lanes_[i]->random_state_;
+        *lanes_[i] = *lanes_[0];
+        lanes_[i]->random_state_ = random_state;
+    }
+    for (int i = 0; i < num_lanes_; i++) {
+        sync_out(i);
+    }
+}
+
+void Chip8Batch::seed(int lane, uint64_t value) { lanes_[lane]->seed(value); }
+
+// Run num_cycles operations in every lane. Lanes are independent, so each group
+// of lanes at the same operation runs as far as it can before the next group.
+void Chip8Batch::cycle(int num_cycles) {
+    for (int i = 0; i < num_lanes_; i++) {
+        cycles_left_[i] = num_cycles;
+    }
+
+    bool running = num_cycles > 0;
+    while (running) {
+        running = false;
+        memset(&done_[0], 0, num_lanes_);
+
+        int num_groups = 0;
+        for (int leader = 0; leader < num_lanes_; leader++) {
+            if (done_[leader] || cycles_left_[leader] == 0) {
+                continue;
+            }
+
+            // Lanes which diverge too much run on their own.
+            if (num_groups == BATCH_MAX_GROUPS) {
+                exec_alone(leader);
+                continue;
+            }
+
+            exec_group(leader);
+            num_groups++;
+            running = true;
+        }
+    }
+}
+
+// Select the lanes with cycles left which are at the leader's program counter and
+// operation, and return their number. Also finds the smallest number of cycles
+// left in the group, and whether all lanes in the group execute the code from
+// the leader's page.
+int Chip8Batch::group(int leader, int& min_left, bool& same_page) {
+    word pc = pc_[leader];
+    int index = (pc >> PAGE_BITS) & (NUM_PAGES - 1);
+    int offset = pc & (PAGE_SIZE - 1);
+    const Page* page = lanes_[leader]->pages_[index];
+    const Operation& op = page->ops[offset];
+
+    int size = 0;
+    min_left = cycles_left_[leader];
+    same_page = true;
+    for (int i = 0; i < num_lanes_; i++) {
+        bool match = !done_[i] && cycles_left_[i] > 0 && pc_[i] == pc;
+        if (match) {
+            const Page* other = lanes_[i]->pages_[index];
+            if (other != page) {
+                const Operation& other_op = other->ops[offset];
+                match = other_op.op == op.op && other_op.nnn == op.nnn;
+                same_page = false;
+            }
+        }
+        if (match) {
+            min_left = cycles_left_[i] < min_left ? cycles_left_[i] : min_left;
+            done_[i] = 1;
+            size++;
+        }
+        mask_[i] = match ? 0xFF : 0x00;
+        wide_mask_[i] = match ? 0xFFFF : 0x0000;
+    }
+
+    return size;
+}
+
+// Whether every lane in the group has the operation at the given address. Lanes
+// which wrote to the page of the code have their own copy of it.
+bool Chip8Batch::same_operation(word pc, const Operation& op) {
+    int index = (pc >> PAGE_BITS) & (NUM_PAGES - 1);
+    int offset = pc & (PAGE_SIZE - 1);
+    for (int i = 0; i < num_lanes_; i++) {
+        if (mask_[i]) {
+            const Operation& other = lanes_[i]->pages_[index]->ops[offset];
+            if (other.op != op.op || other.nnn != op.nnn) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Run the group of the leader. As long as all lanes share the leader's code and
+// operations leave them at the same program counter, the group keeps running.
+void Chip8Batch::exec_group(int leader) {
+    int limit;
+    bool same_page;
+    if (group(leader, limit, same_page) < BATCH_MIN_GROUP) {
+        // Too few lanes to be worth vectorizing.
+        for (int i = 0; i < num_lanes_; i++) {
+            if (mask_[i]) {
+                exec_alone(i);
+            }
+        }
+        return;
+    }
+    const Page* page = lanes_[leader]->pages_[(pc_[leader] >> PAGE_BITS) & (NUM_PAGES - 1)];
+    const Operation* op = &page->ops[pc_[leader] & (PAGE_SIZE - 1)];
+
+    byte* V[REG_SIZE];
+    for (int r = 0; r < REG_SIZE; r++) {
+        V[r] = &V_[r * num_lanes_];
+    }
+
+    int count = 0;
+    if (op->op == OP_JUMP && op->nnn == pc_[leader]) {
+        // A jump to itself never ends, so the lanes spend all their cycles on it.
+        for (int i = 0; i < num_lanes_; i++) {
+            if (mask_[i]) {
+                lanes_[i]->idle_cycles_ += cycles_left_[i] - 1;
+                cycles_left_[i] = 0;
+            }
+        }
+        return;
+    }
+
+    bool delay_loop = false;
+    if (is_vector_op(op->op)) {
+        word pc = pc_[leader];
+        while (true) {
+            // A loop polling the delay timer is skipped ahead instead.
+            if (op->op == OP_GET_DELAY && lanes_[leader]->is_delay_loop(pc)) {
+                delay_loop = true;
+                break;
+            }
+
+            exec_vector(*op, num_lanes_, V, &I_[0], &pc_[0], &delay_timer_[0],
+                    &mask_[0], &wide_mask_[0]);
+            count++;
+
+            // Continue with the next operation if it is in the same page.
+            word next = pc_[leader];
+            if (count >= limit || !is_straight_op(op->op) ||
+                    (next >> PAGE_BITS) != (pc >> PAGE_BITS)) {
+                break;
+            }
+            op = &page->ops[next & (PAGE_SIZE - 1)];
+            if (!is_vector_op(op->op) || (!same_page && !same_operation(next, *op))) {
+                break;
+            }
+            pc = next;
+        }
+    } else {
+        for (int i = 0; i < num_lanes_; i++) {
+            if (mask_[i]) {
+                exec_scalar(i);
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < num_lanes_; i++) {
+        cycles_left_[i] -= mask_[i] ? count : 0;
+    }
+    if (delay_loop) {
+        exec_delay_loop(leader);
+    }
+}
+
+// Run FX07 in a group of lanes at a loop polling the delay timer. The delay timers
+// only change between steps, so the lanes still waiting skip all the rounds of
+// the loop which fit in their cycles left, as Chip8 does; the others carry on.
+void Chip8Batch::exec_delay_loop(int leader) {
+    word pc = pc_[leader];
+    byte x = lanes_[leader]->operation(pc).x;
+    for (int i = 0; i < num_lanes_; i++) {
+        if (!mask_[i]) {
+            continue;
+        }
+        if (!lanes_[i]->is_delay_loop(pc)) {
+            exec_alone(i);
+            continue;
+        }
+
+        V_[x * num_lanes_ + i] = delay_timer_[i];
+        pc_[i] += 2;
+        cycles_left_[i]--;
+        if (delay_timer_[i] != lanes_[i]->operation(pc + 2).nn) {
+            int skipped = cycles_left_[i] / 3 * 3;
+            cycles_left_[i] -= skipped;
+            lanes_[i]->idle_cycles_ += skipped;
+        }
+    }
+}
+
+// Run the remaining cycles of a lane on its own Chip8.
+void Chip8Batch::exec_alone(int lane) {
+    sync_in(lane);
+    lanes_[lane]->cycle(cycles_left_[lane]);
+    sync_out(lane);
+    cycles_left_[lane] = 0;
+}
+
+// Run a lane on its own Chip8 until it reaches an operation which can be vectorized,
+// copying only the registers the operations use. Keys only change between calls
+// to cycle, so a lane waiting for a key press spends the rest of its cycles. The
+// batch counts the cycles of the lane itself, so its handlers never skip.
+void Chip8Batch::exec_scalar(int lane) {
+    Chip8* cpu = lanes_[lane];
+    word synced = used_registers(cpu->operation(pc_[lane]));
+    sync_in(lane, synced);
+    cpu->cycles_left_ = 0;
+    while (true) {
+        cpu->step();
+        cycles_left_[lane]--;
+        if (cpu->store_key_) {
+            cycles_left_[lane] = 0;
+        }
+
+        const Operation& op = cpu->operation(cpu->pc_);
+        if (cycles_left_[lane] == 0 || is_vector_op(op.op)) {
+            break;
+        }
+        word registers = used_registers(op) & ~synced;
+        if (registers != 0) {
+            copy_registers_in(lane, registers);
+            synced |= registers;
+        }
+    }
+    sync_out(lane, synced);
+}
+
+// The delay timers are stored in the batch, the sound timers in the lanes. There
+// is no audio, so the sound is consumed at once.
+void Chip8Batch::update_timers() {
+    for (int i = 0; i < num_lanes_; i++) {
+        delay_timer_[i] -= delay_timer_[i] > 0;
+    }
+    for (int i = 0; i < num_lanes_; i++) {
+        lanes_[i]->update_timers();
+        lanes_[i]->reset_sound_flag();
+    }
+}
+
+void Chip8Batch::set_key(int lane, byte index, bool value) {
+    sync_in(lane);
+    lanes_[lane]->set_key(index, value);
+    sync_out(lane);
+}
+
+void Chip8Batch::save_state(int lane, Chip8State& state) {
+    sync_in(lane);
+    lanes_[lane]->save_state(state);
+}
+
+void Chip8Batch::load_state(int lane, const Chip8State& state) {
+    lanes_[lane]->load_state(state);
+    sync_out(lane);
+}
+
+uint64_t Chip8Batch::get_row(int lane, int y)   { return lanes_[lane]->get_row(y); }
+uint32_t Chip8Batch::get_dirty_rows(int lane)   { return lanes_[lane]->get_dirty_rows(); }
+void Chip8Batch::reset_dirty_rows(int lane)     { lanes_[lane]->reset_dirty_rows(); }
+byte Chip8Batch::get_register(int lane, byte index) { return V_[index * num_lanes_ + lane]; }
+word Chip8Batch::get_pc(int lane)               { return pc_[lane]; }
+word Chip8Batch::get_index(int lane)            { return I_[lane]; }
+uint64_t Chip8Batch::get_idle_cycles(int lane)  { return lanes_[lane]->get_idle_cycles(); }
+
+void Chip8Batch::sync_in(int lane, word registers) {
+    Chip8* cpu = lanes_[lane];
+    copy_registers_in(lane, registers);
+    cpu->I_ = I_[lane];
+    cpu->pc_ = pc_[lane];
+    cpu->delay_timer_ = delay_timer_[lane];
+}
+
+void Chip8Batch::copy_registers_in(int lane, word registers) {
+    Chip8* cpu = lanes_[lane];
+    const byte* V = &V_[lane];
+    for (int r = 0; registers != 0; r++, registers >>= 1) {
+        if (registers & 1) {
+            cpu->V_[r] = V[r * num_lanes_];
+        }
+    }
+}
+
+void Chip8Batch::sync_out(int lane, word registers) {
+    Chip8* cpu = lanes_[lane];
+    byte* V = &V_[lane];
+    for (int r = 0; registers != 0; r++, registers >>= 1) {
+        if (registers & 1) {
+            V[r * num_lanes_] = cpu->V_[r];
+        }
+    }
+    I_[lane] = cpu->I_;
+    pc_[lane] = cpu->pc_;
+    delay_timer_[lane] = cpu->delay_timer_;
+}
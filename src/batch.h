@@ -0,0 +1,70 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <vector>
+#include "chip8.h"
+
+const int BATCH_MAX_GROUPS = 8;     // Groups of lanes per step before going scalar.
+const int BATCH_MIN_GROUP  = 4;     // Lanes in a group to run it vectorized.
+
+// Lockstep engine running many instances of the same ROM. The registers, program
+// counters, index registers and delay timers of all lanes are stored as arrays
+// (structure of arrays). Each step the lanes are grouped by the operation at their
+// program counter; arithmetic, skips, jumps and timer operations are executed for
+// a whole group at once with vector instructions, all other operations run on the
+// lane's own Chip8, which also holds its memory, stack, display and keys.
+class Chip8Batch {
+    public:
+        Chip8Batch(int num_lanes);
+        ~Chip8Batch();
+        int get_num_lanes();
+        void initialize();
+        void load_rom(char* data, int num_bytes);   // Load the ROM in every lane.
+        void seed(int lane, uint64_t value);
+        void cycle(int num_cycles = 1);
+        void update_timers();                       // Also consumes the sound.
+        void set_key(int lane, byte index, bool value);
+        void save_state(int lane, Chip8State& state);
+        void load_state(int lane, const Chip8State& state);
+        uint64_t get_row(int lane, int y);
+        uint32_t get_dirty_rows(int lane);
+        void reset_dirty_rows(int lane);
+        byte get_register(int lane, byte index);
+        word get_pc(int lane);
+        word get_index(int lane);
+        uint64_t get_idle_cycles(int lane);         // Cycles skipped in idle loops.
+    private:
+        Chip8Batch(const Chip8Batch& other);        // Not copyable: owns its lanes.
+        Chip8Batch& operator=(const Chip8Batch& other);
+
+        int num_lanes_;
+        std::vector<Chip8*> lanes_;
+
+        // Registers of all lanes, one array per register (VX of lane i at
+        // V_[x * num_lanes_ + i]):
+        std::vector<byte> V_;
+        std::vector<word> I_, pc_;
+        std::vector<byte> delay_timer_;
+        std::vector<int> cycles_left_;
+
+        // Lanes in the current group (all bits set) and lanes done this step:
+        std::vector<byte> mask_;
+        std::vector<word> wide_mask_;
+        std::vector<byte> done_;
+
+        void fork_lanes();              // Make all lanes forks of the first.
+        int group(int leader, int& min_left, bool& same_page);   // Lanes matching the leader.
+        bool same_operation(word pc, const Operation& op);
+        void exec_group(int leader);    // Run the group of the leader.
+        void exec_delay_loop(int leader);   // Run a group polling the delay timer.
+        void exec_scalar(int lane);     // Run a lane up to the next vector operation.
+        void exec_alone(int lane);      // Run the remaining cycles of a lane.
+
+        // Copy the lane's registers to its Chip8 and back, V registers only as
+        // far as they are in the bit mask:
+        void sync_in(int lane, word registers = 0xFFFF);
+        void sync_out(int lane, word registers = 0xFFFF);
+        void copy_registers_in(int lane, word registers);
+};
+
+#endif //BATCH_H
@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "batch.h"
+#include "chip8.h"
+#include "runner.h"
+
+const int DEFAULT_NUM_RUNS       = 9;
+const long SYNTHETIC_CYCLES      = 2000000;
+const long ROM_CYCLES            = 2000000;
+const int CYCLES_PER_TICK        = 8;
+const int BATCH_LANES            = 64;    // Lanes of the batch engine.
+const word SPRITE_ADDRESS        = 0x400;   // Sprite data of the synthetic programs.
+
+// A synthetic instruction stream: the prologue runs once, after which the body
+// is repeated a number of times inside an endless loop.
+struct Stream {
+    const char* name;
+    word prologue[4];
+    word body[16];
+    int repeat;
+};
+
+const Stream STREAMS[] = {
+    { "alu_8XYN", { 0x6012, 0x6134, 0x6256, 0x6378 },
+      { 0x8014, 0x8125, 0x8231, 0x8302, 0x8013, 0x8126, 0x810E, 0x8237, 0x8120 }, 8 },
+    { "skip_3XNN_9XY0", { 0x6000, 0x6101 },
+      { 0x3001, 0x4000, 0x5010, 0x9000, 0x3000, 0x6000, 0x9010, 0x6000 }, 8 },
+    { "draw_DXY1", { 0xA400, 0x6000, 0x6100 }, { 0xD011 }, 32 },
+    { "draw_DXY8", { 0xA400, 0x6000, 0x6100 }, { 0xD018 }, 32 },
+    { "draw_DXYF", { 0xA400, 0x6000, 0x6100 }, { 0xD01F }, 32 },
+    { "draw_DXYF_wraparound", { 0xA400, 0x603C, 0x611C }, { 0xD01F }, 32 },
+    { "reg_dump_load_FX55_FX65", { 0 }, { 0xA800, 0xFF55, 0xA800, 0xFF65 }, 16 },
+    { "bcd_FX33", { 0xA800, 0x60FE }, { 0xF033, 0x7001 }, 32 },
+};
+
+const int NUM_STREAMS = sizeof(STREAMS) / sizeof(STREAMS[0]);
+
+// Timings of the runs of a single benchmark, in nanoseconds per executed
+// instruction, and the share of the cycles skipped in idle loops instead.
+struct Statistics {
+    double median, min, max, stddev;
+    double idle;
+};
+
+std::vector<char> build_stream(const Stream& stream);   // Assemble a stream.
+Statistics measure(const std::vector<char>& rom, long num_cycles, int num_runs, Engine engine);
+Statistics measure_batch(const std::vector<char>& rom, long num_cycles, int num_runs);
+long executed(long num_cycles, long skipped);   // Instructions not skipped.
+Statistics summarize(std::vector<double>& times, double idle);
+void report(const char* name, const Statistics& stats);
+
+int main(int argc, char *argv[]) {
+    // Parse command line arguments.
+    const char* rom_dir = argc > 1 && strcmp(argv[1], "-") != 0 ? argv[1] : NULL;
+    int num_runs = argc > 2 ? atoi(argv[2]) : DEFAULT_NUM_RUNS;
+    const char* mode = argc > 3 ? argv[3] : "";
+    bool jit = strcmp(mode, "--jit") == 0;
+    bool threaded = strcmp(mode, "--threaded") == 0;
+    bool batch = strcmp(mode, "--batch") == 0;
+    if (num_runs <= 0 || (mode[0] != '\0' && !jit && !threaded && !batch)) {
+        printf("Usage: ./chip8_bench [rom-directory|-] [num-runs] [--jit|--threaded|--batch]\n");
+        return 1;
+    }
+
+    Engine engine = jit ? ENGINE_JIT : threaded ? ENGINE_THREADED : ENGINE_INTERPRETER;
+    Chip8 probe;
+    if (!probe.set_engine(engine)) {
+        printf("%s engine is not supported on this platform.\n", jit ? "JIT" : "Threaded");
+        return 1;
+    }
+
+    printf("%-32s %10s %10s %10s %8s %14s %7s\n", "benchmark", "median ns", "min ns",
+            "max ns", "stddev", "instr/s", "idle");
+
+    // Synthetic instruction streams per opcode family.
+    for (int i = 0; i < NUM_STREAMS; i++) {
+        std::vector<char> rom = build_stream(STREAMS[i]);
+        report(STREAMS[i].name, batch ? measure_batch(rom, SYNTHETIC_CYCLES, num_runs)
+                : measure(rom, SYNTHETIC_CYCLES, num_runs, engine));
+    }
+
+    // Whole ROMs, without key input.
+    std::vector<std::string> roms;
+    if (rom_dir != NULL && !list_roms(rom_dir, roms)) {
+        printf("Failed to read ROM directory.\n");
+        return 1;
+    }
+    for (size_t i = 0; i < roms.size(); i++) {
+        std::vector<char> rom;
+        if (!read_file((std::string(rom_dir) + "/" + roms[i]).c_str(), rom)) {
+            printf("Failed to load ROM: %s\n", roms[i].c_str());
+            return 1;
+        }
+        report(roms[i].c_str(), batch ? measure_batch(rom, ROM_CYCLES, num_runs)
+                : measure(rom, ROM_CYCLES, num_runs, engine));
+    }
+
+    return 0;
+}
+
+std::vector<char> build_stream(const Stream& stream) {
+    std::vector<word> opcodes;
+    for (int i = 0; i < 4 && stream.prologue[i] != 0; i++) {
+        opcodes.push_back(stream.prologue[i]);
+    }
+
+    // Repeat the body and jump back to its start.
+    word loop = 0x200 + 2 * opcodes.size();
+    for (int r = 0; r < stream.repeat; r++) {
+        for (int i = 0; i < 16 && stream.body[i] != 0; i++) {
+            opcodes.push_back(stream.body[i]);
+        }
+    }
+    opcodes.push_back(0x1000 | loop);
+
+    // The sprite data follows the program.
+    std::vector<char> rom(SPRITE_ADDRESS + 16 - 0x200, 0);
+    for (size_t i = 0; i < opcodes.size(); i++) {
+        rom[2 * i]     = opcodes[i] >> 8;
+        rom[2 * i + 1] = opcodes[i] & 0xFF;
+    }
+    for (int i = 0; i < 16; i++) {
+        rom[SPRITE_ADDRESS - 0x200 + i] = i % 2 ? 0x55 : 0xAA;
+    }
+
+    return rom;
+}
+
+// Run the ROM from reset num_runs times after a warm-up run. The cycles skipped
+// in idle loops are not counted as executed instructions.
+Statistics measure(const std::vector<char>& rom, long num_cycles, int num_runs, Engine engine) {
+    const std::vector<KeyEvent> no_events;
+    Chip8 cpu;
+    cpu.set_engine(engine);
+
+    std::vector<double> times;
+    long skipped = 0;
+    for (int run = 0; run <= num_runs; run++) {
+        cpu.initialize();
+        cpu.seed(0);
+        cpu.load_rom((char*) rom.data(), rom.size());
+        uint64_t idle = cpu.get_idle_cycles();
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        run_session(cpu, num_cycles, CYCLES_PER_TICK, no_events);
+        std::chrono::duration<double, std::nano> elapsed =
+                std::chrono::steady_clock::now() - start;
+
+        skipped = cpu.get_idle_cycles() - idle;
+        if (run > 0) {
+            times.push_back(elapsed.count() / executed(num_cycles, skipped));
+        }
+    }
+
+    return summarize(times, (double) skipped / num_cycles);
+}
+
+// Run BATCH_LANES lanes with different seeds in lockstep, for the same total
+// number of instructions as a single session.
+Statistics measure_batch(const std::vector<char>& rom, long num_cycles, int num_runs) {
+    Chip8Batch batch(BATCH_LANES);
+    long num_ticks = num_cycles / BATCH_LANES / CYCLES_PER_TICK;
+
+    long total = num_ticks * CYCLES_PER_TICK * BATCH_LANES;
+
+    std::vector<double> times;
+    long skipped = 0;
+    for (int run = 0; run <= num_runs; run++) {
+        batch.initialize();
+        batch.load_rom((char*) rom.data(), rom.size());
+        uint64_t idle = 0;
+        for (int i = 0; i < BATCH_LANES; i++) {
+            batch.seed(i, i);
+            idle += batch.get_idle_cycles(i);
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (long tick = 0; tick < num_ticks; tick++) {
+            batch.cycle(CYCLES_PER_TICK);
+            batch.update_timers();
+        }
+        std::chrono::duration<double, std::nano> elapsed =
+                std::chrono::steady_clock::now() - start;
+
+        skipped = -(long) idle;
+        for (int i = 0; i < BATCH_LANES; i++) {
+            skipped += batch.get_idle_cycles(i);
+        }
+        if (run > 0) {
+            times.push_back(elapsed.count() / executed(total, skipped));
+        }
+    }
+
+    return summarize(times, (double) skipped / total);
+}
+
+// The number of instructions executed out of num_cycles, of which skipped were
+// skipped in idle loops. At least one, for ROMs which only wait.
+long executed(long num_cycles, long skipped) {
+    return num_cycles - skipped > 0 ? num_cycles - skipped : 1;
+}
+
+// Compute the statistics of the timings of a benchmark.
+Statistics summarize(std::vector<double>& times, double idle) {
+    std::sort(times.begin(), times.end());
+    Statistics stats;
+    stats.median = times[times.size() / 2];
+    stats.min = times.front();
+    stats.max = times.back();
+
+    double mean = 0.0, variance = 0.0;
+    for (size_t i = 0; i < times.size(); i++) {
+        mean += times[i] / times.size();
+    }
+    for (size_t i = 0; i < times.size(); i++) {
+        variance += (times[i] - mean) * (times[i] - mean) / times.size();
+    }
+    stats.stddev = sqrt(variance);
+    stats.idle = idle;
+
+    return stats;
+}
+
+void report(const char* name, const Statistics& stats) {
+    printf("%-32s %10.2f %10.2f %10.2f %7.1f%% %14.0f %6.1f%%\n", name, stats.median,
+            stats.min, stats.max, 100.0 * stats.stddev / stats.median, 1e9 / stats.median,
+            100.0 * stats.idle);
+}
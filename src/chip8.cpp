@@ -1,6 +1,168 @@
 #include "chip8.h"
+#include "fusion.h"
+#include "jit.h"
+#include "profile.h"
+#include "trace.h"
 
-Chip8::Chip8() { srand(time(NULL)); }
+// Labels as values, needed by the threaded interpreter, are a GCC extension which
+// Clang supports as well.
+#if defined(__GNUC__)
+#define CHIP8_COMPUTED_GOTO
+#endif
+
+// Engine of new instances, the threaded interpreter if built with CHIP8_THREADED:
+#if defined(CHIP8_THREADED) && defined(CHIP8_COMPUTED_GOTO)
+static const bool DEFAULT_THREADED = true;
+#else
+static const bool DEFAULT_THREADED = false;
+#endif
+
+byte Chip8::opcodes_[NUM_OPCODES];
+byte Chip8::fusions_[NUM_OPS][NUM_OPS];
+
+const Instruction Chip8::instructions_[NUM_OPS] = {
+    &Chip8::nop,            &Chip8::clear,          &Chip8::ret,
+    &Chip8::jump,           &Chip8::call,           &Chip8::skip_eq_const,
+    &Chip8::skip_neq_const, &Chip8::skip_eq,        &Chip8::assign_const,
+    &Chip8::add_const,      &Chip8::assign,         &Chip8::bitwise_or,
+    &Chip8::bitwise_and,    &Chip8::bitwise_xor,    &Chip8::add,
+    &Chip8::sub,            &Chip8::shift_right,    &Chip8::sub_reverse,
+    &Chip8::shift_left,     &Chip8::skip_neq,       &Chip8::set_index,
+    &Chip8::jump_offset,    &Chip8::random_number,  &Chip8::draw,
+    &Chip8::skip_eq_key,    &Chip8::skip_neq_key,   &Chip8::get_delay,
+    &Chip8::get_key,        &Chip8::set_delay,      &Chip8::set_sound,
+    &Chip8::add_index,      &Chip8::sprite_addr,    &Chip8::bcd,
+    &Chip8::reg_dump,       &Chip8::reg_load
+};
+
+// Fused handlers of the pairs mined from the ROM corpus (fusion.h), from index 1:
+#define FUSED_HANDLER(first_op, first, second_op, second) \
+    &Chip8::fused<&Chip8::first, &Chip8::second>,
+const Instruction Chip8::fused_[] = {
+    NULL,
+    FUSED_PAIRS(FUSED_HANDLER)
+};
+#undef FUSED_HANDLER
+
+Chip8::Chip8() {
+    // The dispatch table is shared by all instances and built only once.
+    static bool built = build_opcodes();
+    (void) built;
+    seed(0);
+
+    for (int i = 0; i < NUM_PAGES; i++) {
+        pages_[i] = new Page();
+        pages_[i]->refs = 1;
+    }
+
+    cycles_left_ = 0;
+    idle_cycles_ = 0;
+    jit_ = NULL;
+    threaded_ = DEFAULT_THREADED;
+    profile_ = NULL;
+    #if defined(CHIP8_TRACE)
+    tracer_ = NULL;
+    #endif
+}
+
+// The fork shares all memory pages with the original and runs on the same engine.
+Chip8::Chip8(const Chip8& other) {
+    for (int i = 0; i < NUM_PAGES; i++) {
+        pages_[i] = other.pages_[i];
+        pages_[i]->refs++;
+    }
+    copy_registers(other);
+
+    cycles_left_ = 0;
+    idle_cycles_ = 0;
+    jit_ = NULL;
+    threaded_ = other.threaded_;
+    profile_ = NULL;
+    #if defined(CHIP8_TRACE)
+    tracer_ = NULL;
+    #endif
+    if (other.jit_ != NULL) {
+        set_engine(ENGINE_JIT);
+    }
+}
+
+// Replace this instance by a fork of other, keeping the selected engine.
+Chip8& Chip8::operator=(const Chip8& other) {
+    if (this != &other) {
+        for (int i = 0; i < NUM_PAGES; i++) {
+            other.pages_[i]->refs++;
+            release_page(pages_[i]);
+            pages_[i] = other.pages_[i];
+        }
+        copy_registers(other);
+
+        if (jit_ != NULL) {
+            jit_->flush();
+        }
+    }
+    return *this;
+}
+
+Chip8::~Chip8() {
+    for (int i = 0; i < NUM_PAGES; i++) {
+        release_page(pages_[i]);
+    }
+    delete jit_;
+    delete profile_;
+    stop_trace();
+}
+
+// Copy everything but the memory.
+void Chip8::copy_registers(const Chip8& other) {
+    memcpy(V_, other.V_, sizeof(V_));
+    I_ = other.I_;
+    pc_ = other.pc_;
+    memcpy(stack_, other.stack_, sizeof(stack_));
+    sp_ = other.sp_;
+    delay_timer_ = other.delay_timer_;
+    memcpy(display_, other.display_, sizeof(display_));
+    draw_flag_ = other.draw_flag_;
+    dirty_rows_ = other.dirty_rows_;
+    memcpy(key_, other.key_, sizeof(key_));
+    store_key_ = other.store_key_;
+    key_index_ = other.key_index_;
+    sound_timer_ = other.sound_timer_;
+    sound_duration_ = other.sound_duration_;
+    sound_flag_ = other.sound_flag_;
+    random_state_ = other.random_state_;
+}
+
+// Resolve every possible opcode to the instruction which executes it, and every
+// pair of instructions to its fused handler.
+bool Chip8::build_opcodes() {
+    for (int opcode = 0; opcode < NUM_OPCODES; opcode++) {
+        opcodes_[opcode] = decode(opcode);
+    }
+
+    int index = 1;
+    #define FUSED_INDEX(first_op, first, second_op, second) \
+        fusions_[first_op][second_op] = can_fuse(first_op) ? index : 0; \
+        index++;
+    FUSED_PAIRS(FUSED_INDEX)
+    #undef FUSED_INDEX
+    return true;
+}
+
+// Whether an instruction can run as the first of a fused pair: it always
+// continues with the next operation, writes no memory (which could change the
+// next operation) and leaves the cycle count alone.
+bool Chip8::can_fuse(byte op) {
+    switch (op) {
+        case OP_NOP: case OP_CLEAR: case OP_ASSIGN_CONST: case OP_ADD_CONST:
+        case OP_ASSIGN: case OP_BITWISE_OR: case OP_BITWISE_AND: case OP_BITWISE_XOR:
+        case OP_ADD: case OP_SUB: case OP_SHIFT_RIGHT: case OP_SUB_REVERSE:
+        case OP_SHIFT_LEFT: case OP_SET_INDEX: case OP_RANDOM_NUMBER: case OP_DRAW:
+        case OP_SET_DELAY: case OP_ADD_INDEX: case OP_SPRITE_ADDR: case OP_REG_LOAD:
+            return true;
+        default:
+            return false;
+    }
+}
 
 void Chip8::initialize() {
     static byte fontset[80] = {
@@ -27,8 +189,8 @@ void Chip8::initialize() {
     sp_ = 0;     // Reset stack pointer.
     
     // Clear memory:
-    for (int i = 0; i < MEM_SIZE; i++) {
-        memory_[i] = 0;
+    for (int i = 0; i < NUM_PAGES; i++) {
+        memset(own_page(i)->memory, 0, PAGE_SIZE);
     }
 
     // Clear general purpose registers:
@@ -43,10 +205,9 @@ void Chip8::initialize() {
 
     // Clear display
     draw_flag_ = true;
-    for (int i = 0; i < DISPLAY_WIDTH; i++) {
-        for (int j = 0; j < DISPLAY_HEIGHT; j++) {
-            display_[i][j] = 0;
-        }
+    dirty_rows_ = 0xFFFFFFFF;
+    for (int i = 0; i < DISPLAY_HEIGHT; i++) {
+        display_[i] = 0;
     }
 
     // Reset keys
@@ -55,31 +216,183 @@ void Chip8::initialize() {
     }
 
     // Load fontset:
-    for (int i = 0; i < 80; i++) {
-        memory_[i] = fontset[i];
-    }
+    memcpy(pages_[0]->memory, fontset, sizeof(fontset));
     
-    // Reset timers:
-    delay_timer_ = sound_timer_ = 0;
+    // Reset timers and sound:
+    delay_timer_ = sound_timer_ = sound_duration_ = 0;
+    sound_flag_ = false;
 
     // Reset store key flag:
     store_key_ = false;
+    key_index_ = 0;
+
+    // Memory was rewritten, so decode all operations again:
+    for (int i = 0; i < MEM_SIZE; i++) {
+        fetch(i);
+    }
+    if (jit_ != NULL) {
+        jit_->flush();
+    }
 }
 
-// Fetch, decode and execute the next operation.
-void Chip8::cycle(int num_cycles) {
-    while (num_cycles > 0) {
-        opcode_ = memory_[pc_] << 8 | memory_[pc_ + 1];
-        exec_operation();
-        num_cycles--;
+// Select the engine used to execute operations. Returns false if the engine
+// is not supported on this platform.
+bool Chip8::set_engine(Engine engine) {
+    #if !defined(CHIP8_COMPUTED_GOTO)
+    if (engine == ENGINE_THREADED) {
+        return false;
     }
+    #endif
+    threaded_ = engine == ENGINE_THREADED;
+
+    if (engine == ENGINE_JIT) {
+        if (!Jit::is_supported()) {
+            return false;
+        }
+        if (jit_ == NULL) {
+            jit_ = new Jit();
+        }
+    } else {
+        delete jit_;
+        jit_ = NULL;
+    }
+    return true;
+}
+
+// Seed the random number generator, which makes CXNN reproducible.
+void Chip8::seed(uint64_t value) {
+    random_state_ = 0;
+    next_random();
+    random_state_ += value;
+    next_random();
+}
+
+// Take a snapshot of the machine state.
+void Chip8::save_state(Chip8State& state) {
+    memcpy(state.display, display_, sizeof(display_));
+    state.random_state = random_state_;
+    state.I = I_;
+    state.pc = pc_;
+    memcpy(state.stack, stack_, sizeof(stack_));
+    state.sp = sp_;
+    memcpy(state.V, V_, sizeof(V_));
+    state.delay_timer = delay_timer_;
+    state.sound_timer = sound_timer_;
+    state.sound_duration = sound_duration_;
+    state.sound_flag = sound_flag_;
+    memcpy(state.key, key_, sizeof(key_));
+    state.store_key = store_key_;
+    state.key_index = key_index_;
+    for (int i = 0; i < NUM_PAGES; i++) {
+        memcpy(state.memory + i * PAGE_SIZE, pages_[i]->memory, PAGE_SIZE);
+    }
+}
+
+// Restore a snapshot of the machine state. Only the pages of memory which
+// differ from the snapshot are written, and the whole display is marked for
+// redrawing.
+void Chip8::load_state(const Chip8State& state) {
+    memcpy(display_, state.display, sizeof(display_));
+    draw_flag_ = true;
+    dirty_rows_ = 0xFFFFFFFF;
+    random_state_ = state.random_state;
+    I_ = state.I;
+    pc_ = state.pc;
+    memcpy(stack_, state.stack, sizeof(stack_));
+    sp_ = state.sp;
+    memcpy(V_, state.V, sizeof(V_));
+    delay_timer_ = state.delay_timer;
+    sound_timer_ = state.sound_timer;
+    sound_duration_ = state.sound_duration;
+    sound_flag_ = state.sound_flag;
+    memcpy(key_, state.key, sizeof(key_));
+    store_key_ = state.store_key;
+    key_index_ = state.key_index;
+
+    for (int i = 0; i < NUM_PAGES; i++) {
+        const byte* memory = state.memory + i * PAGE_SIZE;
+        if (memcmp(pages_[i]->memory, memory, PAGE_SIZE) != 0) {
+            write(i * PAGE_SIZE, memory, PAGE_SIZE);
+        }
+    }
+}
+
+// Advance the PCG32 generator and return the top byte of its output.
+byte Chip8::next_random() {
+    uint64_t state = random_state_;
+    random_state_ = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint32_t xorshifted = ((state >> 18) ^ state) >> 27;
+    uint32_t rotation = state >> 59;
+    uint32_t output = (xorshifted >> rotation) | (xorshifted << ((-rotation) & 31));
+    return output >> 24;
+}
+
+// Fetch, decode and execute the next operations. Returns false if the cpu is
+// halted in FX0A, waiting for a key press: the cycles left were used up at once.
+// Only the interpreters (the dispatch table and the threaded one) skip idle
+// loops, by using up cycles_left_. Tracing and profiling count every cycle and
+// the JIT counts them per block, so for those cycles_left_ is 0 and the handlers
+// never skip.
+bool Chip8::cycle(int num_cycles) {
+    bool counted = jit_ != NULL || profile_ != NULL;
+    #if defined(CHIP8_TRACE)
+    counted = counted || tracer_ != NULL;
+    #endif
+    cycles_left_ = counted ? 0 : num_cycles;
+
+    #if defined(CHIP8_TRACE)
+    if (tracer_ != NULL) {
+        while (num_cycles > 0) {
+            trace_step();
+            num_cycles--;
+        }
+        return !store_key_;
+    }
+    #endif
+
+    if (profile_ != NULL) {
+        while (num_cycles > 0) {
+            profile_step();
+            num_cycles--;
+        }
+        return !store_key_;
+    }
+
+    if (jit_ != NULL) {
+        jit_->run(this, num_cycles);
+        return !store_key_;
+    }
+
+    if (threaded_) {
+        run_threaded();
+        return !store_key_;
+    }
+
+    // Pairs of operations with a fused handler run in one dispatch when both fit.
+    while (cycles_left_ > 0) {
+        op_ = &operation(pc_);
+        if (op_->fused != 0 && cycles_left_ > 1) {
+            (this->*fused_[op_->fused])();
+        } else {
+            exec_operation();
+        }
+        cycles_left_--;
+    }
+    return !store_key_;
+}
+
+// Whether the cpu waits for a key in FX0A with both timers stopped. Then nothing
+// changes until a key is pressed, and frontends can block until then.
+bool Chip8::is_halted() {
+    return store_key_ && delay_timer_ == 0 && sound_timer_ == 0;
 }
 
 // Load the rom into memory.
 void Chip8::load_rom(char* data, int num_bytes) {
-    for (int i = 0; i < num_bytes; i++) {
-        memory_[0x200 + i] = (byte) data[i];
+    if (num_bytes > MEM_SIZE - 0x200) {
+        num_bytes = MEM_SIZE - 0x200;
     }
+    write(0x200, (byte*) data, num_bytes);
 }
 
 // Update the delay and sound timer.
@@ -98,83 +411,395 @@ void Chip8::set_key(byte index, bool value) {
     }
 }
 
-bool Chip8::is_pixel(int x, int y) { return display_[x][y]; }
+bool Chip8::is_pixel(int x, int y) { return (display_[y] >> (63 - x)) & 0x1; }
+uint64_t Chip8::get_row(int y) { return display_[y]; }
+uint32_t Chip8::get_dirty_rows() { return dirty_rows_; }
+void Chip8::reset_dirty_rows() { dirty_rows_ = 0; }
 bool Chip8::is_draw_flag() { return draw_flag_; }
 bool Chip8::is_sound_flag() { return sound_flag_; }
 void Chip8::reset_draw_flag() { draw_flag_ = false; }
 void Chip8::reset_sound_flag() { sound_flag_ = false; }
 byte Chip8::get_sound_duration() { return sound_duration_; }
+byte Chip8::get_register(byte index) { return V_[index]; }
+word Chip8::get_pc() { return pc_; }
+word Chip8::get_index() { return I_; }
+byte Chip8::get_memory(word address) { return read(address); }
+
+// Record the executed instructions into a trace file. Returns false if the file
+// cannot be created or tracing is compiled out (CHIP8_TRACE is not defined).
+// While tracing, the operations are interpreted even if the JIT is selected.
+bool Chip8::start_trace(const char* path) {
+    #if defined(CHIP8_TRACE)
+    stop_trace();
+    tracer_ = new TraceWriter();
+    if (!tracer_->open(path, pc_, I_, V_)) {
+        stop_trace();
+        return false;
+    }
+    return true;
+    #else
+    (void) path;
+    return false;
+    #endif
+}
+
+// Stop tracing and write the rest of the trace file.
+void Chip8::stop_trace() {
+    #if defined(CHIP8_TRACE)
+    delete tracer_;
+    tracer_ = NULL;
+    #endif
+}
+
+// Start counting the executed operations from zero, or stop counting. While
+// profiling, the operations are interpreted even if the JIT is selected.
+void Chip8::set_profiling(bool enabled) {
+    delete profile_;
+    profile_ = NULL;
+    if (enabled) {
+        profile_ = new Profile();
+        memset(profile_->ops, 0, sizeof(profile_->ops));
+        memset(profile_->pcs, 0, sizeof(profile_->pcs));
+        memset(profile_->pairs, 0, sizeof(profile_->pairs));
+        profile_->last_pc = profile_->last_op = 0;
+        profile_->cycles = profile_->key_wait_cycles = 0;
+        profile_->key_wait_seconds = 0;
+        profile_->waiting = false;
+    }
+}
+
+const Profile* Chip8::get_profile() { return profile_; }
+uint64_t Chip8::get_idle_cycles() { return idle_cycles_; }
+
+// Read a byte of memory. Addresses wrap around at the end of memory.
+byte Chip8::read(word address) {
+    return pages_[(address >> PAGE_BITS) & (NUM_PAGES - 1)]->memory[address & (PAGE_SIZE - 1)];
+}
 
-// Decode and execute the operation.
+// Read len bytes of memory starting at address, one page at a time.
+void Chip8::read(word address, byte* data, int len) {
+    while (len > 0) {
+        address &= MEM_SIZE - 1;
+        int offset = address & (PAGE_SIZE - 1);
+        int count = len < PAGE_SIZE - offset ? len : PAGE_SIZE - offset;
+        memcpy(data, pages_[address >> PAGE_BITS]->memory + offset, count);
+        address += count;
+        data += count;
+        len -= count;
+    }
+}
+
+// The predecoded operation at the given address.
+const Operation& Chip8::operation(word address) {
+    return pages_[(address >> PAGE_BITS) & (NUM_PAGES - 1)]->ops[address & (PAGE_SIZE - 1)];
+}
+
+// Write len bytes to memory starting at address, one page at a time. Shared
+// pages are copied only if the write changes them, after which the operations
+// overlapping the written bytes, and those fused with them, are decoded again.
+void Chip8::write(word address, const byte* data, int len) {
+    bool changed = false;
+    for (int i = 0; i < len; ) {
+        word a = (address + i) & (MEM_SIZE - 1);
+        int offset = a & (PAGE_SIZE - 1);
+        int count = len - i < PAGE_SIZE - offset ? len - i : PAGE_SIZE - offset;
+        if (memcmp(pages_[a >> PAGE_BITS]->memory + offset, data + i, count) != 0) {
+            memcpy(own_page(a >> PAGE_BITS)->memory + offset, data + i, count);
+            changed = true;
+        }
+        i += count;
+    }
+
+    if (changed) {
+        for (int i = -3; i < len; i++) {
+            fetch(address + i);
+        }
+        if (jit_ != NULL) {
+            jit_->invalidate(address, len);
+        }
+    }
+}
+
+// Return the page at index for writing, copying it first if it is shared.
+Page* Chip8::own_page(int index) {
+    Page* page = pages_[index];
+    if (page->refs > 1) {
+        Page* copy = new Page();
+        copy->refs = 1;
+        memcpy(copy->memory, page->memory, sizeof(page->memory));
+        memcpy(copy->ops, page->ops, sizeof(page->ops));
+        release_page(page);
+        pages_[index] = page = copy;
+    }
+    return page;
+}
+
+void Chip8::release_page(Page* page) {
+    if (--page->refs == 0) {
+        delete page;
+    }
+}
+
+// Decode the operation at the given address into its page, together with the
+// fused handler of it and the next operation. The page is only written, and thus
+// copied if shared, when the operation changes.
+void Chip8::fetch(word address) {
+    address &= MEM_SIZE - 1;
+    word opcode = read(address) << 8 | read(address + 1);
+    word next = read(address + 2) << 8 | read(address + 3);
+
+    Operation op;
+    op.op    = opcodes_[opcode];
+    op.x     = (opcode & 0x0F00) >> 8;
+    op.y     = (opcode & 0x00F0) >> 4;
+    op.n     = opcode & 0x000F;
+    op.nn    = opcode & 0x00FF;
+    op.nnn   = opcode & 0x0FFF;
+    op.fused = fusions_[op.op][opcodes_[next]];
+
+    const Operation& old = operation(address);
+    if (old.op != op.op || old.nnn != op.nnn || old.fused != op.fused) {
+        own_page(address >> PAGE_BITS)->ops[address & (PAGE_SIZE - 1)] = op;
+    }
+}
+
+// Fetch, decode and execute the next operation.
+void Chip8::step() {
+    op_ = &operation(pc_);
+    exec_operation();
+}
+
+// Fetch, decode and execute the next operation, and pass it to the tracer.
+void Chip8::trace_step() {
+    #if defined(CHIP8_TRACE)
+    word pc = pc_;
+    word opcode = read(pc) << 8 | read(pc + 1);
+    if (profile_ != NULL) {
+        profile_step();
+    } else {
+        step();
+    }
+    tracer_->record(pc, opcode, pc_, I_, V_);
+    #endif
+}
+
+// Fetch, decode and execute the next operation, counting it by instruction and
+// address, and by pair of instructions if it follows the last one in memory. A
+// wait for a key is timed from the first cycle FX0A finds no key to the first
+// cycle after a key was pressed.
+void Chip8::profile_step() {
+    word pc = pc_ & (MEM_SIZE - 1);
+    byte op = operation(pc).op;
+    step();
+    profile_->cycles++;
+    profile_->ops[op]++;
+    profile_->pcs[pc]++;
+    if (profile_->cycles > 1 && pc == ((profile_->last_pc + 2) & (MEM_SIZE - 1))) {
+        profile_->pairs[profile_->last_op][op]++;
+    }
+    profile_->last_pc = pc;
+    profile_->last_op = op;
+
+    if (store_key_) {
+        profile_->key_wait_cycles++;
+        if (!profile_->waiting) {
+            profile_->waiting = true;
+            profile_->wait_start = std::chrono::steady_clock::now();
+        }
+    } else if (profile_->waiting) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() -
+                profile_->wait_start;
+        profile_->key_wait_seconds += elapsed.count();
+        profile_->waiting = false;
+    }
+}
+
+// Whether the operation at address is FX07 followed by 3XNN on the same register
+// and a jump back to the FX07: a loop polling the delay timer until it is NN.
+bool Chip8::is_delay_loop(word address) {
+    const Operation& get = operation(address);
+    const Operation& skip = operation(address + 2);
+    const Operation& jump = operation(address + 4);
+    return get.op == OP_GET_DELAY && skip.op == OP_SKIP_EQ_CONST && skip.x == get.x &&
+            jump.op == OP_JUMP && jump.nnn == (address & (MEM_SIZE - 1));
+}
+
+// Called after FX07 ran. If it polls the delay timer in a loop, nothing changes
+// until the timers are updated, which happens between calls to cycle(); every
+// round of three operations leaves the machine in the same state. So the rounds
+// which fit in the cycles left are skipped at once, ending at the same state
+// and cycle as running them.
+void Chip8::skip_delay_loop() {
+    word address = pc_ - 2;
+    if (!is_delay_loop(address) || operation(pc_).nn == delay_timer_) {
+        return;
+    }
+    int skipped = (cycles_left_ - 1) / 3 * 3;
+    cycles_left_ -= skipped;
+    idle_cycles_ += skipped;
+}
+
+// Execute the current operation through the dispatch table.
 inline void Chip8::exec_operation() {
-    switch ((opcode_ & 0xF000) >> 12) {
-        case 0x0:   exec_zero();        break;  // 0XYZ
-        case 0x1:   jump();             break;  // 1NNN
-        case 0x2:   call();             break;  // 2NNN
-        case 0x3:   skip_eq_const();    break;  // 3XNN
-        case 0x4:   skip_neq_const();   break;  // 4XNN
-        case 0x5:   skip_eq();          break;  // 5XY0
-        case 0x6:   assign_const();     break;  // 6XNN
-        case 0x7:   add_const();        break;  // 7XNN
-        case 0x8:   exec_arithmetic();  break;  // 8XYZ
-        case 0x9:   skip_neq();         break;  // 9XY0
-        case 0xA:   set_index();        break;  // ANNN
-        case 0xB:   jump_offset();      break;  // BNNN
-        case 0xC:   random_number();    break;  // CXNN
-        case 0xD:   draw();             break;  // DXYN
-        case 0xE:   exec_key();         break;  // EXYZ
-        case 0xF:   exec_memory();      break;  // FXYZ
-        default:    nop();              break;
-    }
-}
-
-// Decode and execute operations starting with 0.
-inline void Chip8::exec_zero() {
-    switch (opcode_ & 0x0FFF) {
-        case 0x0E0: clear();            break;  // 00E0
-        case 0x0EE: ret();              break;  // 00EE
-        default:    nop();              break;
-    }
-}
-
-// Decode and execute operations starting with 8.
-inline void Chip8::exec_arithmetic() {
-    switch (opcode_ & 0x000F) {
-        case 0x0:   assign();           break;  // 8XY0
-        case 0x1:   bitwise_or();       break;  // 8XY1
-        case 0x2:   bitwise_and();      break;  // 8XY2
-        case 0x3:   bitwise_xor();      break;  // 8XY3
-        case 0x4:   add();              break;  // 8XY4
-        case 0x5:   sub();              break;  // 8XY5
-        case 0x6:   shift_right();      break;  // 8XY6
-        case 0x7:   sub_reverse();      break;  // 8XY7
-        case 0xE:   shift_left();       break;  // 8XYE
-        default:    nop();              break;
-    }
-}
-
-// Decode and execute operations starting with E.
-inline void Chip8::exec_key() {
-    switch (opcode_ & 0x00FF) {
-        case 0x9E:  skip_eq_key();      break;  // EX9E
-        case 0xA1:  skip_neq_key();     break;  // EXA1
-        default:    nop();              break;
-    }
-}
-
-// Decode and execute operations starting with F.
-inline void Chip8::exec_memory() {
-    switch (opcode_ & 0x00FF) {
-        case 0x07:  get_delay();        break;  // FX07
-        case 0x0A:  get_key();          break;  // FX0A
-        case 0x15:  set_delay();        break;  // FX15
-        case 0x18:  set_sound();        break;  // FX18
-        case 0x1E:  add_index();        break;  // FX1E
-        case 0x29:  sprite_addr();      break;  // FX29
-        case 0x33:  bcd();              break;  // FX33
-        case 0x55:  reg_dump();         break;  // FX55
-        case 0x65:  reg_load();         break;  // FX65
-        default:    nop();              break;
+    (this->*instructions_[op_->op])();
+}
+
+// Execute the current operation, which always continues with the next one, and
+// then that one, with both handlers known at compile time. The first cycle is
+// counted in between, so the second handler sees the cycles left as usual.
+template <Instruction First, Instruction Second>
+void Chip8::fused() {
+    (this->*First)();
+    cycles_left_--;
+    op_ = &operation(pc_);
+    (this->*Second)();
+}
+
+// Execute the cycles left with a threaded interpreter. Instead of returning to a
+// shared dispatch site, every handler ends in its own indirect jump to the handler
+// of the next operation, so the branch predictor sees which instruction follows
+// which. The handlers are the same inline functions the interpreter calls, and
+// the cycles are counted the same way.
+void Chip8::run_threaded() {
+    #if defined(CHIP8_COMPUTED_GOTO)
+    static void* const labels[NUM_OPS] = {
+        &&l_nop,            &&l_clear,          &&l_ret,
+        &&l_jump,           &&l_call,           &&l_skip_eq_const,
+        &&l_skip_neq_const, &&l_skip_eq,        &&l_assign_const,
+        &&l_add_const,      &&l_assign,         &&l_bitwise_or,
+        &&l_bitwise_and,    &&l_bitwise_xor,    &&l_add,
+        &&l_sub,            &&l_shift_right,    &&l_sub_reverse,
+        &&l_shift_left,     &&l_skip_neq,       &&l_set_index,
+        &&l_jump_offset,    &&l_random_number,  &&l_draw,
+        &&l_skip_eq_key,    &&l_skip_neq_key,   &&l_get_delay,
+        &&l_get_key,        &&l_set_delay,      &&l_set_sound,
+        &&l_add_index,      &&l_sprite_addr,    &&l_bcd,
+        &&l_reg_dump,       &&l_reg_load
+    };
+
+    #define DISPATCH()                      \
+        if (--cycles_left_ <= 0) {          \
+            return;                         \
+        }                                   \
+        op_ = &operation(pc_);              \
+        goto *labels[op_->op]
+
+    if (cycles_left_ <= 0) {
+        return;
+    }
+    op_ = &operation(pc_);
+    goto *labels[op_->op];
+
+    l_nop:              nop();              DISPATCH();
+    l_clear:            clear();            DISPATCH();
+    l_ret:              ret();              DISPATCH();
+    l_jump:             jump();             DISPATCH();
+    l_call:             call();             DISPATCH();
+    l_skip_eq_const:    skip_eq_const();    DISPATCH();
+    l_skip_neq_const:   skip_neq_const();   DISPATCH();
+    l_skip_eq:          skip_eq();          DISPATCH();
+    l_assign_const:     assign_const();     DISPATCH();
+    l_add_const:        add_const();        DISPATCH();
+    l_assign:           assign();           DISPATCH();
+    l_bitwise_or:       bitwise_or();       DISPATCH();
+    l_bitwise_and:      bitwise_and();      DISPATCH();
+    l_bitwise_xor:      bitwise_xor();      DISPATCH();
+    l_add:              add();              DISPATCH();
+    l_sub:              sub();              DISPATCH();
+    l_shift_right:      shift_right();      DISPATCH();
+    l_sub_reverse:      sub_reverse();      DISPATCH();
+    l_shift_left:       shift_left();       DISPATCH();
+    l_skip_neq:         skip_neq();         DISPATCH();
+    l_set_index:        set_index();        DISPATCH();
+    l_jump_offset:      jump_offset();      DISPATCH();
+    l_random_number:    random_number();    DISPATCH();
+    l_draw:             draw();             DISPATCH();
+    l_skip_eq_key:      skip_eq_key();      DISPATCH();
+    l_skip_neq_key:     skip_neq_key();     DISPATCH();
+    l_get_delay:        get_delay();        DISPATCH();
+    l_get_key:          get_key();          DISPATCH();
+    l_set_delay:        set_delay();        DISPATCH();
+    l_set_sound:        set_sound();        DISPATCH();
+    l_add_index:        add_index();        DISPATCH();
+    l_sprite_addr:      sprite_addr();      DISPATCH();
+    l_bcd:              bcd();              DISPATCH();
+    l_reg_dump:         reg_dump();         DISPATCH();
+    l_reg_load:         reg_load();         DISPATCH();
+
+    #undef DISPATCH
+    #endif
+}
+
+// Decode the operation into the instruction which executes it.
+Op Chip8::decode(word opcode) {
+    switch ((opcode & 0xF000) >> 12) {
+        case 0x0:   return decode_zero(opcode);         // 0XYZ
+        case 0x1:   return OP_JUMP;                     // 1NNN
+        case 0x2:   return OP_CALL;                     // 2NNN
+        case 0x3:   return OP_SKIP_EQ_CONST;            // 3XNN
+        case 0x4:   return OP_SKIP_NEQ_CONST;           // 4XNN
+        case 0x5:   return OP_SKIP_EQ;                  // 5XY0
+        case 0x6:   return OP_ASSIGN_CONST;             // 6XNN
+        case 0x7:   return OP_ADD_CONST;                // 7XNN
+        case 0x8:   return decode_arithmetic(opcode);   // 8XYZ
+        case 0x9:   return OP_SKIP_NEQ;                 // 9XY0
+        case 0xA:   return OP_SET_INDEX;                // ANNN
+        case 0xB:   return OP_JUMP_OFFSET;              // BNNN
+        case 0xC:   return OP_RANDOM_NUMBER;            // CXNN
+        case 0xD:   return OP_DRAW;                     // DXYN
+        case 0xE:   return decode_key(opcode);          // EXYZ
+        case 0xF:   return decode_memory(opcode);       // FXYZ
+        default:    return OP_NOP;
+    }
+}
+
+// Decode operations starting with 0.
+Op Chip8::decode_zero(word opcode) {
+    switch (opcode & 0x0FFF) {
+        case 0x0E0: return OP_CLEAR;                    // 00E0
+        case 0x0EE: return OP_RET;                      // 00EE
+        default:    return OP_NOP;
+    }
+}
+
+// Decode operations starting with 8.
+Op Chip8::decode_arithmetic(word opcode) {
+    switch (opcode & 0x000F) {
+        case 0x0:   return OP_ASSIGN;                   // 8XY0
+        case 0x1:   return OP_BITWISE_OR;               // 8XY1
+        case 0x2:   return OP_BITWISE_AND;              // 8XY2
+        case 0x3:   return OP_BITWISE_XOR;              // 8XY3
+        case 0x4:   return OP_ADD;                      // 8XY4
+        case 0x5:   return OP_SUB;                      // 8XY5
+        case 0x6:   return OP_SHIFT_RIGHT;              // 8XY6
+        case 0x7:   return OP_SUB_REVERSE;              // 8XY7
+        case 0xE:   return OP_SHIFT_LEFT;               // 8XYE
+        default:    return OP_NOP;
+    }
+}
+
+// Decode operations starting with E.
+Op Chip8::decode_key(word opcode) {
+    switch (opcode & 0x00FF) {
+        case 0x9E:  return OP_SKIP_EQ_KEY;              // EX9E
+        case 0xA1:  return OP_SKIP_NEQ_KEY;             // EXA1
+        default:    return OP_NOP;
+    }
+}
+
+// Decode operations starting with F.
+Op Chip8::decode_memory(word opcode) {
+    switch (opcode & 0x00FF) {
+        case 0x07:  return OP_GET_DELAY;                // FX07
+        case 0x0A:  return OP_GET_KEY;                  // FX0A
+        case 0x15:  return OP_SET_DELAY;                // FX15
+        case 0x18:  return OP_SET_SOUND;                // FX18
+        case 0x1E:  return OP_ADD_INDEX;                // FX1E
+        case 0x29:  return OP_SPRITE_ADDR;              // FX29
+        case 0x33:  return OP_BCD;                      // FX33
+        case 0x55:  return OP_REG_DUMP;                 // FX55
+        case 0x65:  return OP_REG_LOAD;                 // FX65
+        default:    return OP_NOP;
     }
 }
 
@@ -185,12 +810,11 @@ inline void Chip8::nop() {
 
 // 00E0: Clears the screen.
 inline void Chip8::clear() {
-    for (int i = 0; i < DISPLAY_WIDTH; i++) {
-        for (int j = 0; j < DISPLAY_HEIGHT; j++) {
-            display_[i][j] = 0;
-        }
+    for (int i = 0; i < DISPLAY_HEIGHT; i++) {
+        display_[i] = 0;
     }
     draw_flag_ = true;
+    dirty_rows_ = 0xFFFFFFFF;
     pc_ += 2;
 }
 
@@ -199,73 +823,77 @@ inline void Chip8::ret() {
     pc_ = stack_[--sp_] + 2;
 }
 
-// 1NNN: Jump to address NNN.
+// 1NNN: Jump to address NNN. A jump to itself never ends, so it uses up the
+// cycles left at once.
 inline void Chip8::jump() {
-    pc_ = opcode_ & 0x0FFF;
+    if (op_->nnn == pc_ && cycles_left_ > 1) {
+        idle_cycles_ += cycles_left_ - 1;
+        cycles_left_ = 1;
+    }
+    pc_ = op_->nnn;
 }
 
 // 2NNN: Calls subroutine at NNN.
 inline void Chip8::call() {
     stack_[sp_++] = pc_;
-    pc_ = opcode_ & 0x0FFF;
+    pc_ = op_->nnn;
 }
 
 // 3XNN: Skips the next instruction if VX == NN.
 inline void Chip8::skip_eq_const() {
-    pc_ = V_[(opcode_ & 0x0F00) >> 8] == (opcode_ & 0x00FF) ? pc_ + 4 : pc_ + 2;
+    pc_ = V_[op_->x] == op_->nn ? pc_ + 4 : pc_ + 2;
 }
 
 // 4XNN: Skips the next instruction if VX != NN.
 inline void Chip8::skip_neq_const() {
-    pc_ = V_[(opcode_ & 0x0F00) >> 8] != (opcode_ & 0x00FF) ? pc_ + 4 : pc_ + 2;
+    pc_ = V_[op_->x] != op_->nn ? pc_ + 4 : pc_ + 2;
 }
 
 // 5XY0: Skips the next instruction if VX == VY.
 inline void Chip8::skip_eq() {
-    pc_ = V_[(opcode_ & 0x0F00) >> 8] == V_[(opcode_ & 0x00F0) >> 4] &&
-        (opcode_ & 0x000F) == 0 ? pc_ + 4 : pc_ + 2;
+    pc_ = V_[op_->x] == V_[op_->y] && op_->n == 0 ? pc_ + 4 : pc_ + 2;
 }
 
 // 6XNN: Set VX to NN.
 inline void Chip8::assign_const() {
-    V_[(opcode_ & 0x0F00) >> 8]  = opcode_ & 0x00FF;
+    V_[op_->x]  = op_->nn;
     pc_ += 2;
 }
 
 // 7XNN: Add NN to VX.
 inline void Chip8::add_const() {
-    V_[(opcode_ & 0x0F00) >> 8] += opcode_ & 0x00FF;
+    V_[op_->x] += op_->nn;
     pc_ += 2;
 }
 
 // 8XY0: Assign VY to VX.
 inline void Chip8::assign() {
-    V_[(opcode_ & 0x0F00) >> 8]  = V_[(opcode_ & 0x00F0) >> 4];
+    V_[op_->x]  = V_[op_->y];
     pc_ += 2;
 }
 
 // 8XY1: Set VX to VX or VY (Bitwise OR).
 inline void Chip8::bitwise_or() {
-    V_[(opcode_ & 0x0F00) >> 8] |= V_[(opcode_ & 0x00F0) >> 4];
+    V_[op_->x] |= V_[op_->y];
     pc_ += 2;
 }
 
 // 8XY2: Set VX to VX and VY (Bitwise AND).
 inline void Chip8::bitwise_and() {
-    V_[(opcode_ & 0x0F00) >> 8] &= V_[(opcode_ & 0x00F0) >> 4];
+    V_[op_->x] &= V_[op_->y];
     pc_ += 2;
 }
 
 // 8XY3: Set VX to VX xor VY (Bitwise XOR).
 inline void Chip8::bitwise_xor() {
-    V_[(opcode_ & 0x0F00) >> 8] ^= V_[(opcode_ & 0x00F0) >> 4];
+    V_[op_->x] ^= V_[op_->y];
     pc_ += 2;
 }
 
 // 8XY4: Adds VY to VX. Set VF to 1 if there is a carry.
 inline void Chip8::add() {
-    byte X = (opcode_ & 0x0F00) >> 8;
-    byte Y = (opcode_ & 0x00F0) >> 4;
+    byte X = op_->x;
+    byte Y = op_->y;
     V_[0xF] = V_[X] + V_[Y] > 0xFF ? 1 : 0;
     V_[X] = V_[X] + V_[Y];
     pc_ += 2;
@@ -273,8 +901,8 @@ inline void Chip8::add() {
 
 // 8XY5: Substract VY from VX. Set VF to 0 if there is a borrow.
 inline void Chip8::sub() {
-    byte X = (opcode_ & 0x0F00) >> 8;
-    byte Y = (opcode_ & 0x00F0) >> 4;
+    byte X = op_->x;
+    byte Y = op_->y;
     V_[0xF] = V_[X] < V_[Y] ? 0 : 1;
     V_[X] = V_[X] - V_[Y];
     pc_ += 2;
@@ -282,7 +910,7 @@ inline void Chip8::sub() {
 
 // 8XY6: Set VF to the least significant bit of VX and shift VX right by 1.
 inline void Chip8::shift_right() {
-    byte X = (opcode_ & 0x0F00) >> 8;
+    byte X = op_->x;
     V_[0xF] = V_[X] & 0x1;
     V_[X] >>= 1;
     pc_ += 2;
@@ -290,8 +918,8 @@ inline void Chip8::shift_right() {
 
 // 8XY7: Sets VX to VY minus VX. Set VF to 0 if there is a borrow.
 inline void Chip8::sub_reverse() {
-    byte X = (opcode_ & 0x0F00) >> 8;
-    byte Y = (opcode_ & 0x00F0) >> 4;
+    byte X = op_->x;
+    byte Y = op_->y;
     V_[0xF] = V_[Y] < V_[X] ? 0 : 1;
     V_[X] = V_[Y] - V_[X];
     pc_ += 2;
@@ -299,7 +927,7 @@ inline void Chip8::sub_reverse() {
 
 // 8XYE: Set VF to the most significant bit of VX and shift VX left by 1.
 inline void Chip8::shift_left() {
-    byte X = (opcode_ & 0x0F00) >> 8;
+    byte X = op_->x;
     V_[0xF] = V_[X] >> 7;
     V_[X] <<= 1;
     pc_ += 2;
@@ -307,65 +935,76 @@ inline void Chip8::shift_left() {
 
 // 9XY0: Skips the next instruction if VX != VY.
 inline void Chip8::skip_neq() {
-    pc_ = V_[(opcode_ & 0x0F00) >> 8] != V_[(opcode_ & 0x00F0) >> 4] &&
-        (opcode_ & 0x000F) == 0 ? pc_ + 4 : pc_ + 2;
+    pc_ = V_[op_->x] != V_[op_->y] && op_->n == 0 ? pc_ + 4 : pc_ + 2;
 }
 
 // ANNN: Sets I to the address NNN.
 inline void Chip8::set_index() {
-    I_ = opcode_ & 0x0FFF;
+    I_ = op_->nnn;
     pc_ += 2;
 }
 
 // BNNN: Jumps to the address NNN plus V0.
 inline void Chip8::jump_offset() {
-    pc_ = V_[0] + (opcode_ & 0x0FFF);
+    pc_ = V_[0] + op_->nnn;
 }
 
 // CXNN: Sets VX to a random number with a mask of NN.
 inline void Chip8::random_number() {
-    V_[(opcode_ & 0x0F00) >> 8] = (rand() % 256) & (opcode_ & 0x00FF);
+    V_[op_->x] = next_random() & op_->nn;
     pc_ += 2;
 }
 
 // DXYN: Draws the (bit-coded) sprite stored at address I at coordinate (VX, VY)
 // of size 8xN. Set VF to 1 if any pixel is flipped from set to unset (collision).
+// Each sprite line is rotated into place in a display row, which wraps it around
+// the right edge of the screen.
 inline void Chip8::draw() {
-    int x_start = V_[(opcode_ & 0x0F00) >> 8];
-    int y_start = V_[(opcode_ & 0x00F0) >> 4];
-    int height  = opcode_ & 0x000F;
-    V_[0xF] = 0x00;
-
-    for (int line = 0; line < height; line++) {
-        for (int bit = 0; bit < 8; bit++) {
-            bool pixel = (memory_[I_ + line] >> (7 - bit)) & 0x01;
-            int x = (x_start + bit ) % DISPLAY_WIDTH;
-            int y = (y_start + line) % DISPLAY_HEIGHT;
-            if (display_[x][y] && pixel) {
-                V_[0xF] = 0x01; // collision
-            }
-            display_[x][y] ^= pixel;
-        }
+    int x = V_[op_->x] % DISPLAY_WIDTH;
+    int y = V_[op_->y];
+    uint64_t collision = 0;
+
+    // Read the sprite in place, unless it crosses a page.
+    byte lines[16];
+    const byte* data = lines;
+    word offset = I_ & (PAGE_SIZE - 1);
+    if (I_ < MEM_SIZE && offset + op_->n <= PAGE_SIZE) {
+        data = pages_[I_ >> PAGE_BITS]->memory + offset;
+    } else {
+        read(I_, lines, op_->n);
+    }
+
+    for (int line = 0; line < op_->n; line++) {
+        uint64_t sprite = (uint64_t) data[line] << 56;
+        sprite = (sprite >> x) | (sprite << ((64 - x) & 63));
+        int row = (y + line) % DISPLAY_HEIGHT;
+        collision |= display_[row] & sprite;
+        display_[row] ^= sprite;
+        dirty_rows_ |= (uint32_t) (sprite != 0) << row;
     }
 
+    V_[0xF] = collision != 0;
     draw_flag_ = true;
     pc_ += 2;
 }
 
 // EX9E: Skips the next instruction if the key stored in VX is pressed.
 inline void Chip8::skip_eq_key() {
-    pc_ = key_[V_[(opcode_ & 0x0F00) >> 8]] ? pc_ + 4 : pc_ + 2;
+    pc_ = key_[V_[op_->x]] ? pc_ + 4 : pc_ + 2;
 }
 
 // EXA1: Skips the next instruction if the key stored in VX is not pressed.
 inline void Chip8::skip_neq_key() {
-    pc_ = key_[V_[(opcode_ & 0x0F00) >> 8]] ? pc_ + 2 : pc_ + 4;
+    pc_ = key_[V_[op_->x]] ? pc_ + 2 : pc_ + 4;
 }
 
 // FX07: Sets VX to the value of the delay timer.
 inline void Chip8::get_delay() {
-    V_[(opcode_ & 0x0F00) >> 8] = delay_timer_;
+    V_[op_->x] = delay_timer_;
     pc_ += 2;
+    if (cycles_left_ > 3) {
+        skip_delay_loop();
+    }
 }
 
 // FX0A: A key press is awaited, and then stored in VX.
@@ -374,28 +1013,34 @@ inline void Chip8::get_key() {
         // Check if any key is already pressed and if so store it in VX.
         for (byte i = 0; i < 16; i++) {
             if (key_[i]) {
-                V_[(opcode_ & 0x0F00) >> 8] = i;
+                V_[op_->x] = i;
                 pc_ += 2;
                 return;
             }
         }
 
         // If no key was pressed then store the next keypress in VX.
-        key_index_ = (opcode_ & 0x0F00) >> 8;
+        key_index_ = op_->x;
         store_key_ = true;
     }
+
+    // Keys are only pressed between calls to cycle(), so halt for the cycles left.
+    if (cycles_left_ > 1) {
+        idle_cycles_ += cycles_left_ - 1;
+        cycles_left_ = 1;
+    }
 }
 
 // FX15: Sets the delay timer to VX.
 inline void Chip8::set_delay() {
-    delay_timer_ = V_[(opcode_ & 0x0F00) >> 8];
+    delay_timer_ = V_[op_->x];
     pc_ += 2;
 }
 
 // FX18: Sets the sound timer to VX.
 inline void Chip8::set_sound() {
     if (!sound_flag_) {
-        sound_timer_ = sound_duration_ = V_[(opcode_ & 0x0F00) >> 8];
+        sound_timer_ = sound_duration_ = V_[op_->x];
         sound_flag_ = true;
         pc_ += 2;
     }
@@ -403,13 +1048,13 @@ inline void Chip8::set_sound() {
 
 // FX1E: Adds VX to I.
 inline void Chip8::add_index() {
-    I_ += V_[(opcode_ & 0x0F00) >> 8];
+    I_ += V_[op_->x];
     pc_ += 2;
 }
 
 // FX29: Sets I to the location of the sprite for the character in VX.
 inline void Chip8::sprite_addr() {
-    I_ = 5 * V_[(opcode_ & 0x0F00) >> 8];
+    I_ = 5 * V_[op_->x];
     pc_ += 2;
 }
 
@@ -417,25 +1062,23 @@ inline void Chip8::sprite_addr() {
 // ficant of three digits at address I, the middle digit at addres I plus one, and
 // and the least significant digit at I plus two.
 inline void Chip8::bcd() {
-    byte X = (opcode_ & 0x0F00) >> 8;
-    memory_[I_]   = V_[X] / 100;
-    memory_[I_+1] = (V_[X] / 10) % 10;
-    memory_[I_+2] = (V_[X] % 100) % 10;
+    byte X = op_->x;
+    byte digits[3];
+    digits[0] = V_[X] / 100;
+    digits[1] = (V_[X] / 10) % 10;
+    digits[2] = (V_[X] % 100) % 10;
+    write(I_, digits, 3);
     pc_ += 2;
 }
 
 // FX55: Stores V0 to VX (including) in memory starting at address I.
 inline void Chip8::reg_dump() {
-    for (byte i = 0; i <= (opcode_ & 0x0F00) >> 8; i++) {
-        memory_[I_+i] = V_[i];
-    }
+    write(I_, V_, op_->x + 1);
     pc_ += 2;
 }
 
 // FX65: Fills V0 to VX (including) with values from memory starting at address I.
 inline void Chip8::reg_load() {
-    for (byte i = 0; i <= (opcode_ & 0x0F00) >> 8; i++) {
-        V_[i] = memory_[I_+i];
-    }
+    read(I_, V_, op_->x + 1);
     pc_ += 2;
 }
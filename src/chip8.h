@@ -1,13 +1,19 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
+#include <stdint.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
+#include <atomic>
 
 class Chip8;
+class Jit;
+class TraceWriter;
+struct Profile;
 
 typedef unsigned char byte;
 typedef unsigned short word;
+typedef void (Chip8::*Instruction)();
 
 const int MEM_SIZE       = 4096;
 const int REG_SIZE       = 16;
@@ -15,24 +21,105 @@ const int STACK_SIZE     = 16;
 const int DISPLAY_WIDTH  = 64;
 const int DISPLAY_HEIGHT = 32;
 const int NUM_KEYS       = 16;
+const int NUM_OPCODES    = 0x10000;
+const int PAGE_BITS      = 8;
+const int PAGE_SIZE      = 1 << PAGE_BITS;
+const int NUM_PAGES      = MEM_SIZE / PAGE_SIZE;
+
+// Instructions, used as index into the instruction handlers:
+enum Op {
+    OP_NOP, OP_CLEAR, OP_RET, OP_JUMP, OP_CALL, OP_SKIP_EQ_CONST, OP_SKIP_NEQ_CONST,
+    OP_SKIP_EQ, OP_ASSIGN_CONST, OP_ADD_CONST, OP_ASSIGN, OP_BITWISE_OR,
+    OP_BITWISE_AND, OP_BITWISE_XOR, OP_ADD, OP_SUB, OP_SHIFT_RIGHT, OP_SUB_REVERSE,
+    OP_SHIFT_LEFT, OP_SKIP_NEQ, OP_SET_INDEX, OP_JUMP_OFFSET, OP_RANDOM_NUMBER,
+    OP_DRAW, OP_SKIP_EQ_KEY, OP_SKIP_NEQ_KEY, OP_GET_DELAY, OP_GET_KEY, OP_SET_DELAY,
+    OP_SET_SOUND, OP_ADD_INDEX, OP_SPRITE_ADDR, OP_BCD, OP_REG_DUMP, OP_REG_LOAD,
+    NUM_OPS
+};
+
+// Execution engines:
+enum Engine {
+    ENGINE_INTERPRETER, // Execute predecoded operations one at a time.
+    ENGINE_JIT,         // Execute basic blocks recompiled to native code.
+    ENGINE_THREADED     // Jump from each handler straight to the next one.
+};
+
+// A predecoded operation with its operands extracted from the opcode.
+struct Operation {
+    byte op;            // The instruction (Op).
+    byte x, y, n, nn;   // Operands X, Y, N and NN.
+    byte fused;         // Handler of this and the next operation, 0 if none.
+    word nnn;           // Operand NNN.
+};
+
+// A page of memory together with the operation decoded at each of its addresses.
+// Forked instances share their pages until one of them writes to a page, which
+// then gets its own copy (copy-on-write).
+struct Page {
+    std::atomic<int> refs;      // Number of instances sharing the page.
+    byte memory[PAGE_SIZE];
+    Operation ops[PAGE_SIZE];
+};
+
+// A snapshot of the complete machine state. It holds no pointers, so it can
+// be copied with memcpy and restored into any instance.
+struct Chip8State {
+    uint64_t display[DISPLAY_HEIGHT];   // Display rows.
+    uint64_t random_state;              // Random number generator.
+    word I, pc;                         // Index register and program counter.
+    word stack[STACK_SIZE];             // Stack.
+    byte sp;                            // Stack pointer.
+    byte V[REG_SIZE];                   // General purpose registers.
+    byte delay_timer, sound_timer;      // Timers.
+    byte sound_duration;                // Duration of the last sound.
+    bool sound_flag;                    // Sound started since the last reset.
+    bool key[NUM_KEYS];                 // Key status.
+    bool store_key;                     // FX0A is waiting for a key press.
+    byte key_index;                     // Register receiving the key of FX0A.
+    byte memory[MEM_SIZE];              // Memory.
+};
 
 class Chip8 {
     public:
         Chip8();
+        Chip8(const Chip8& other);              // Fork a running instance.
+        Chip8& operator=(const Chip8& other);   // Replace by a fork of other.
+        ~Chip8();
         void initialize();
-        void cycle(int num_cycles);
+        bool set_engine(Engine engine);
+        void seed(uint64_t value);
+        void save_state(Chip8State& state);
+        void load_state(const Chip8State& state);
+        bool cycle(int num_cycles = 1);         // False while waiting for a key.
+        bool is_halted();                       // Nothing runs until a key press.
         void update_timers();
         void load_rom(char* data, int num_bytes);
         void set_key(byte index, bool value);
         bool is_pixel(int x, int y);
+        uint64_t get_row(int y);
+        uint32_t get_dirty_rows();
+        void reset_dirty_rows();
         bool is_draw_flag();
         bool is_sound_flag();
         void reset_draw_flag();
         void reset_sound_flag();
         byte get_sound_duration();
+        byte get_register(byte index);
+        word get_pc();
+        word get_index();
+        byte get_memory(word address);
+        bool start_trace(const char* path);     // Record the executed instructions.
+        void stop_trace();
+        void set_profiling(bool enabled);       // Count the executed operations.
+        const Profile* get_profile();           // Counts, or NULL if not profiling.
+        uint64_t get_idle_cycles();             // Cycles skipped in idle loops.
+        static bool can_fuse(byte op);          // Whether op can start a fused pair.
     private:
-        // Memory and general purpose registers:
-        byte memory_[MEM_SIZE], V_[REG_SIZE];
+        // Memory, in pages which are shared with forks until written:
+        Page* pages_[NUM_PAGES];
+
+        // General purpose registers:
+        byte V_[REG_SIZE];
 
         // The index register and program counter:
         word I_, pc_;
@@ -44,13 +131,36 @@ class Chip8 {
         // Delay timer:
         byte delay_timer_;
 
-        // Current opcode:
-        word opcode_;
+        // Current operation:
+        const Operation* op_;
+
+        // Cycles left to run by cycle(), which idle loops use up at once, and
+        // the number of cycles skipped that way:
+        int cycles_left_;
+        uint64_t idle_cycles_;
 
-        // The display:
-        bool display_[DISPLAY_WIDTH][DISPLAY_HEIGHT];
+        // Dynamic recompiler, only present when the JIT engine is selected:
+        Jit* jit_;
+
+        // Whether the threaded interpreter is selected:
+        bool threaded_;
+
+        // Execution counts, only present while profiling:
+        Profile* profile_;
+
+        #if defined(CHIP8_TRACE)
+        // Instruction recorder, only present while tracing:
+        TraceWriter* tracer_;
+        #endif
+
+        // The display, one row per word with the leftmost pixel in the most
+        // significant bit:
+        uint64_t display_[DISPLAY_HEIGHT];
         bool draw_flag_;
 
+        // Rows changed since the last reset, one bit per row:
+        uint32_t dirty_rows_;
+
         // Key status:
         bool key_[NUM_KEYS], store_key_;
         byte key_index_;
@@ -59,12 +169,47 @@ class Chip8 {
         byte sound_timer_, sound_duration_;
         bool sound_flag_;
 
+        // Random number generator (PCG32), owned by each instance:
+        uint64_t random_state_;
+
+        // Dispatch tables mapping every opcode to its instruction and every
+        // instruction to its handler:
+        static byte opcodes_[NUM_OPCODES];
+        static const Instruction instructions_[NUM_OPS];
+        static bool build_opcodes();
+
+        // Fused handlers, executing a frequent pair of adjacent operations in
+        // one dispatch, and the handler of each pair of instructions:
+        static const Instruction fused_[];
+        static byte fusions_[NUM_OPS][NUM_OPS];
+
+        byte next_random();     // Advance the random number generator.
+
+        // Paged memory with predecoded operations:
+        byte read(word address);                // Read a byte of memory.
+        void read(word address, byte* data, int len);        // Read len bytes.
+        void write(word address, const byte* data, int len); // Write and decode.
+        const Operation& operation(word address);   // Operation at address.
+        void fetch(word address);               // Decode the operation at address.
+        Page* own_page(int index);              // Copy a shared page before writing.
+        static void release_page(Page* page);   // Drop a reference to a page.
+        void copy_registers(const Chip8& other);
+
         // Decoding and executing operations:
-        void exec_operation();  // Decode and execute the operation.
-        void exec_zero();       // Decode and execute operations starting with 0.
-        void exec_arithmetic(); // Decode and execute operations starting with 8.
-        void exec_key();        // Decode and execute operations starting with E.
-        void exec_memory();     // Decode and execute operations starting with F.
+        void step();            // Fetch, decode and execute the next operation.
+        void run_threaded();    // Execute the cycles left, threaded.
+        void trace_step();      // Execute and record the next operation.
+        void profile_step();    // Execute and count the next operation.
+        bool is_delay_loop(word address);   // FX07 polled by 3XNN and 1NNN.
+        void skip_delay_loop(); // Skip the rounds of a delay loop due.
+        void exec_operation();  // Execute the operation through the dispatch table.
+        template <Instruction First, Instruction Second>
+        void fused();           // Execute a fused pair of operations.
+        static Op decode(word opcode);            // Decode the operation.
+        static Op decode_zero(word opcode);       // Decode operations 0XYZ.
+        static Op decode_arithmetic(word opcode); // Decode operations 8XYZ.
+        static Op decode_key(word opcode);        // Decode operations EXYZ.
+        static Op decode_memory(word opcode);     // Decode operations FXYZ.
 
         // Instructions:
         void nop();
@@ -103,6 +248,9 @@ class Chip8 {
         void reg_dump();        // FX55: Stores V0 to VX in memory starting at addr I.
         void reg_load();        // FX65: Fills V0 to VX from mem starting at addr I.
 
+    friend class Jit;
+    friend class Chip8Batch;
+
     #if defined(UNIT_TEST)
     friend class Chip8Test;
     #endif
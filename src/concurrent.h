@@ -0,0 +1,86 @@
+#ifndef CONCURRENT_H
+#define CONCURRENT_H
+
+#include <atomic>
+
+const int CACHE_LINE_SIZE = 64;
+
+// Lock-free triple buffer handing the newest value from one producer thread to
+// one consumer thread. The producer fills the back buffer and publishes it by
+// swapping it with the middle buffer; the consumer swaps the middle buffer with
+// its front buffer when a new value was published. Neither side ever waits, and
+// values the consumer did not pick up in time are overwritten.
+template <class T>
+class TripleBuffer {
+    public:
+        TripleBuffer() : back_(0), middle_(1), front_(2) {}
+
+        T& get_back() { return buffers_[back_]; }           // Buffer to fill.
+        const T& get_front() { return buffers_[front_]; }   // Newest buffer taken.
+
+        // Publish the back buffer (producer).
+        void publish() {
+            back_ = middle_.exchange(back_ | FRESH, std::memory_order_acq_rel) & INDEX;
+        }
+
+        // Take the newest published buffer, returns false if there is none (consumer).
+        bool update() {
+            if ((middle_.load(std::memory_order_relaxed) & FRESH) == 0) {
+                return false;
+            }
+            front_ = middle_.exchange(front_, std::memory_order_acq_rel) & INDEX;
+            return true;
+        }
+    private:
+        static const int INDEX = 0x3;   // Index of the middle buffer.
+        static const int FRESH = 0x4;   // Set when the middle buffer was published.
+
+        T buffers_[3];
+        int back_;
+        alignas(CACHE_LINE_SIZE) std::atomic<int> middle_;
+        alignas(CACHE_LINE_SIZE) int front_;
+};
+
+// Lock-free bounded queue between one producer thread and one consumer thread.
+// The capacity must be a power of two.
+template <class T, int CAPACITY>
+class SpscQueue {
+    public:
+        SpscQueue() : head_(0), tail_(0) {}
+
+        // Append a value, returns false if the queue is full (producer).
+        bool push(const T& value) {
+            unsigned int tail = tail_.load(std::memory_order_relaxed);
+            if (tail - head_.load(std::memory_order_acquire) == CAPACITY) {
+                return false;
+            }
+            values_[tail & (CAPACITY - 1)] = value;
+            tail_.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Whether there is no value to pop (consumer).
+        bool empty() {
+            return head_.load(std::memory_order_relaxed) ==
+                    tail_.load(std::memory_order_acquire);
+        }
+
+        // Remove the oldest value, returns false if the queue is empty (consumer).
+        bool pop(T& value) {
+            unsigned int head = head_.load(std::memory_order_relaxed);
+            if (head == tail_.load(std::memory_order_acquire)) {
+                return false;
+            }
+            value = values_[head & (CAPACITY - 1)];
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+    private:
+        static_assert((CAPACITY & (CAPACITY - 1)) == 0, "capacity must be a power of two");
+
+        T values_[CAPACITY];
+        alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> head_;  // Next value to pop.
+        alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> tail_;  // Next slot to push.
+};
+
+#endif //CONCURRENT_H
@@ -0,0 +1,130 @@
+#include "env.h"
+
+// Eight pixels of a display row, as they are laid out in an observation.
+static uint64_t pixels_[256];
+
+static bool build_pixels() {
+    for (int bits = 0; bits < 256; bits++) {
+        byte pixels[8];
+        for (int i = 0; i < 8; i++) {
+            pixels[i] = (bits >> (7 - i)) & 0x1;
+        }
+        memcpy(&pixels_[bits], pixels, 8);
+    }
+    return true;
+}
+
+Chip8Env::Chip8Env(int num_envs, int cycles_per_frame, int frames_per_step) :
+        num_envs_(num_envs), cycles_per_frame_(cycles_per_frame),
+        frames_per_step_(frames_per_step), reward_hook_(NULL), done_hook_(NULL),
+        reward_data_(NULL), done_data_(NULL), last_observations_(NULL) {
+    // The pixel table is shared by all instances and built only once.
+    static bool built = build_pixels();
+    (void) built;
+
+    for (int i = 0; i < num_envs_; i++) {
+        cpus_.push_back(new Chip8());
+        seeds_.push_back(i);
+        keys_.push_back(0);
+    }
+}
+
+Chip8Env::~Chip8Env() {
+    for (int i = 0; i < num_envs_; i++) {
+        delete cpus_[i];
+    }
+}
+
+int Chip8Env::get_num_envs() { return num_envs_; }
+
+bool Chip8Env::set_engine(Engine engine) {
+    for (int i = 0; i < num_envs_; i++) {
+        if (!cpus_[i]->set_engine(engine)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Load the ROM every episode starts from. Takes effect at the next reset.
+void Chip8Env::load_rom(char* data, int num_bytes) {
+    initial_.initialize();
+    initial_.load_rom(data, num_bytes);
+}
+
+void Chip8Env::seed(int env, uint64_t value) { seeds_[env] = value; }
+
+void Chip8Env::set_reward_hook(RewardHook hook, void* data) {
+    reward_hook_ = hook;
+    reward_data_ = data;
+}
+
+void Chip8Env::set_done_hook(DoneHook hook, void* data) {
+    done_hook_ = hook;
+    done_data_ = data;
+}
+
+void Chip8Env::reset(byte* observations) {
+    for (int i = 0; i < num_envs_; i++) {
+        reset(i);
+        observe(i, observations + i * OBSERVATION_SIZE, true);
+    }
+    last_observations_ = observations;
+}
+
+// Every episode starts as a fork of the initial state, which shares its memory.
+// Each episode is seeded with the next seed of the environment, so consecutive
+// episodes differ but a run can be reproduced.
+void Chip8Env::reset(int env) {
+    *cpus_[env] = initial_;
+    cpus_[env]->seed(seeds_[env]++);
+    keys_[env] = 0;
+}
+
+void Chip8Env::step(const word* actions, byte* observations, float* rewards, bool* dones) {
+    bool same_buffer = observations == last_observations_;
+    for (int i = 0; i < num_envs_; i++) {
+        Chip8& cpu = *cpus_[i];
+
+        // Press and release the keys which changed.
+        word changed = actions[i] ^ keys_[i];
+        for (byte key = 0; changed != 0; key++, changed >>= 1) {
+            if (changed & 1) {
+                cpu.set_key(key, (actions[i] >> key) & 1);
+            }
+        }
+        keys_[i] = actions[i];
+
+        for (int frame = 0; frame < frames_per_step_; frame++) {
+            cpu.cycle(cycles_per_frame_);
+            cpu.update_timers();
+            cpu.reset_sound_flag();
+        }
+
+        rewards[i] = reward_hook_ != NULL ? reward_hook_(i, cpu, reward_data_) : 0.0f;
+        dones[i] = done_hook_ != NULL && done_hook_(i, cpu, done_data_);
+        if (dones[i]) {
+            reset(i);
+        }
+        observe(i, observations + i * OBSERVATION_SIZE, dones[i] || !same_buffer);
+    }
+    last_observations_ = observations;
+}
+
+// Write the screen of an environment, eight pixels at a time.
+void Chip8Env::observe(int env, byte* observation, bool all_rows) {
+    Chip8& cpu = *cpus_[env];
+    uint32_t rows = all_rows ? 0xFFFFFFFF : cpu.get_dirty_rows();
+    for (int y = 0; rows != 0; y++, rows >>= 1) {
+        if (rows & 1) {
+            uint64_t row = cpu.get_row(y);
+            byte* pixels = observation + y * DISPLAY_WIDTH;
+            for (int i = 0; i < 8; i++) {
+                memcpy(pixels + 8 * i, &pixels_[(row >> (56 - 8 * i)) & 0xFF], 8);
+            }
+        }
+    }
+    cpu.reset_dirty_rows();
+}
+
+Chip8& Chip8Env::get_cpu(int env) { return *cpus_[env]; }
@@ -0,0 +1,59 @@
+#ifndef ENV_H
+#define ENV_H
+
+#include <vector>
+#include "chip8.h"
+
+const int OBSERVATION_SIZE = DISPLAY_WIDTH * DISPLAY_HEIGHT;   // Bytes per screen.
+
+// Hooks evaluated after every step of an environment, with the user data given
+// when setting them: the reward of the step and whether the episode has ended.
+typedef float (*RewardHook)(int env, Chip8& cpu, void* data);
+typedef bool (*DoneHook)(int env, Chip8& cpu, void* data);
+
+// A batch of environments running the same ROM, for training loops. Each step
+// holds the keys of the actions, runs a number of frames and writes the screens
+// into a caller provided uint8 tensor of num_envs x 32 x 64 pixels (0 or 1).
+// Environments whose episode has ended are reset at the end of the step, so the
+// observation returned with done set is the first one of the next episode.
+class Chip8Env {
+    public:
+        Chip8Env(int num_envs, int cycles_per_frame = 8, int frames_per_step = 1);
+        ~Chip8Env();
+        int get_num_envs();
+        bool set_engine(Engine engine);
+        void load_rom(char* data, int num_bytes);
+        void seed(int env, uint64_t value);     // Seed of the next episode.
+        void set_reward_hook(RewardHook hook, void* data = NULL);
+        void set_done_hook(DoneHook hook, void* data = NULL);
+        void reset(byte* observations);         // Start a new episode everywhere.
+
+        // Run one step. The action of an environment is the set of keys held
+        // down during the step, one bit per key:
+        void step(const word* actions, byte* observations, float* rewards, bool* dones);
+
+        Chip8& get_cpu(int env);
+    private:
+        Chip8Env(const Chip8Env& other);        // Not copyable: owns its instances.
+        Chip8Env& operator=(const Chip8Env& other);
+
+        int num_envs_, cycles_per_frame_, frames_per_step_;
+        Chip8 initial_;                 // State at the start of an episode.
+        std::vector<Chip8*> cpus_;
+        std::vector<uint64_t> seeds_;   // Seed of the next episode per environment.
+        std::vector<word> keys_;        // Keys held down per environment.
+
+        RewardHook reward_hook_;
+        DoneHook done_hook_;
+        void* reward_data_;
+        void* done_data_;
+
+        // Buffer the screens were last written to; only the rows which changed
+        // since then are written again when the same buffer is passed:
+        const byte* last_observations_;
+
+        void reset(int env);            // Start a new episode in one environment.
+        void observe(int env, byte* observation, bool all_rows);
+};
+
+#endif //ENV_H
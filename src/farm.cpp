@@ -0,0 +1,218 @@
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include "chip8.h"
+#include "runner.h"
+
+const int DEFAULT_CYCLES_PER_TICK = 8;
+
+// A session to run: a ROM under a key script with a seed for the random numbers.
+struct Job {
+    std::string rom, script;
+    uint64_t seed;
+
+    // Results:
+    word pc, index;
+    unsigned int checksum;
+    double seconds;
+};
+
+// Jobs of a single worker. The worker takes jobs from the back, idle workers
+// steal from the front.
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<int> jobs;
+};
+
+std::vector<Job> jobs;
+std::vector<WorkQueue> queues;
+std::map<std::string, std::vector<char> > roms;
+std::map<std::string, std::vector<KeyEvent> > scripts;
+long num_cycles;
+int cycles_per_tick;
+
+bool read_jobs(const char* path);               // Read the job file.
+bool load_inputs();                             // Read all ROMs and key scripts once.
+bool take_job(int worker, int& job);            // Take a job, stealing if needed.
+void work(int worker);                          // Run jobs until all are done.
+unsigned int checksum(Chip8& cpu);              // Hash the registers and display.
+
+int main(int argc, char *argv[]) {
+    // Parse command line arguments.
+    if (argc < 3) {
+        printf("Error: missing argument.\n");
+        printf("Usage: ./chip8_farm <job-file> <num-cycles> [cycles-per-tick] "
+                "[num-threads]\n");
+        return 1;
+    }
+
+    num_cycles = atol(argv[2]);
+    cycles_per_tick = argc > 3 ? atoi(argv[3]) : DEFAULT_CYCLES_PER_TICK;
+    int num_threads = argc > 4 ? atoi(argv[4]) : std::thread::hardware_concurrency();
+    if (num_cycles < 0 || cycles_per_tick <= 0) {
+        printf("Invalid number of cycles.\n");
+        return 1;
+    }
+    if (num_threads <= 0) {
+        num_threads = 1;
+    }
+
+    if (!read_jobs(argv[1]) || !load_inputs()) {
+        return 1;
+    }
+
+    // Deal the jobs round-robin over the workers.
+    queues = std::vector<WorkQueue>(num_threads);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        queues[i % num_threads].jobs.push_back(i);
+    }
+
+    // Run all jobs.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < num_threads; i++) {
+        workers.push_back(std::thread(work, i));
+    }
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Report the results in job order.
+    for (size_t i = 0; i < jobs.size(); i++) {
+        Job& job = jobs[i];
+        printf("%s %s %llu PC: 0x%03X I: 0x%03X checksum: %08X time: %.6f s\n",
+                job.rom.c_str(), job.script.c_str(), (unsigned long long) job.seed,
+                job.pc, job.index,
+                job.checksum, job.seconds);
+    }
+
+    double total_cycles = (double) num_cycles * jobs.size();
+    printf("Jobs: %zu\n", jobs.size());
+    printf("Threads: %d\n", num_threads);
+    printf("Time: %.6f s\n", elapsed.count());
+    printf("Cycles per second: %.0f\n", elapsed.count() > 0 ? total_cycles / elapsed.count() : 0.0);
+
+    return 0;
+}
+
+// Each line of the job file holds a ROM path, a key script path (or - for
+// none) and a seed. Empty lines and lines starting with # are ignored.
+bool read_jobs(const char* path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        printf("Failed to load job file.\n");
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        Job job = Job();
+        if (!(fields >> job.rom >> job.script >> job.seed)) {
+            printf("Invalid job: %s\n", line.c_str());
+            return false;
+        }
+        jobs.push_back(job);
+    }
+
+    return true;
+}
+
+bool load_inputs() {
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const std::string& rom = jobs[i].rom;
+        if (roms.count(rom) == 0 && !read_file(rom.c_str(), roms[rom])) {
+            printf("Failed to load ROM: %s\n", rom.c_str());
+            return false;
+        }
+
+        const std::string& script = jobs[i].script;
+        if (script != "-" && scripts.count(script) == 0 &&
+                !read_key_script(script.c_str(), scripts[script])) {
+            printf("Failed to load key script: %s\n", script.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool take_job(int worker, int& job) {
+    // Take the most recently dealt job of our own queue.
+    {
+        WorkQueue& queue = queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.jobs.empty()) {
+            job = queue.jobs.back();
+            queue.jobs.pop_back();
+            return true;
+        }
+    }
+
+    // Steal the oldest job of another queue.
+    for (size_t i = 1; i < queues.size(); i++) {
+        WorkQueue& queue = queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.jobs.empty()) {
+            job = queue.jobs.front();
+            queue.jobs.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void work(int worker) {
+    // Each worker reuses its own instance for all of its jobs.
+    Chip8* cpu = new Chip8();
+    const std::vector<KeyEvent> no_events;
+
+    int index;
+    while (take_job(worker, index)) {
+        Job& job = jobs[index];
+        const std::vector<char>& rom = roms.at(job.rom);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        cpu->initialize();
+        cpu->seed(job.seed);
+        cpu->load_rom((char*) rom.data(), rom.size());
+        run_session(*cpu, num_cycles, cycles_per_tick,
+                job.script == "-" ? no_events : scripts.at(job.script));
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        job.pc = cpu->get_pc();
+        job.index = cpu->get_index();
+        job.checksum = checksum(*cpu);
+        job.seconds = elapsed.count();
+    }
+
+    delete cpu;
+}
+
+// FNV-1a hash of the registers and the display.
+unsigned int checksum(Chip8& cpu) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < REG_SIZE; i++) {
+        hash = (hash ^ cpu.get_register(i)) * 16777619u;
+    }
+    for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+        uint64_t row = cpu.get_row(y);
+        for (int i = 0; i < 8; i++) {
+            hash = (hash ^ ((row >> (8 * i)) & 0xFF)) * 16777619u;
+        }
+    }
+    return hash;
+}
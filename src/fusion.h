@@ -0,0 +1,25 @@
+// Generated by chip8_mine from the 72 ROMs in roms/, do not edit. To regenerate:
+//
+//     ./chip8_mine ../roms 12 > ../src/fusion.h
+//
+// The pairs of adjacent instructions executed most, which the interpreter runs
+// with a fused handler, and their share of the executed instructions averaged
+// over the ROMs.
+#ifndef FUSION_H
+#define FUSION_H
+
+#define FUSED_PAIRS(PAIR) \
+    PAIR(OP_ASSIGN_CONST, assign_const, OP_SKIP_NEQ_KEY, skip_neq_key) /* 6XNN EXA1  3.69% */ \
+    PAIR(OP_ADD_CONST, add_const, OP_SKIP_EQ_CONST, skip_eq_const)     /* 7XNN 3XNN  1.78% */ \
+    PAIR(OP_SET_INDEX, set_index, OP_DRAW, draw)                       /* ANNN DXYN  0.97% */ \
+    PAIR(OP_ASSIGN_CONST, assign_const, OP_BITWISE_AND, bitwise_and)   /* 6XNN 8XY2  0.65% */ \
+    PAIR(OP_DRAW, draw, OP_ADD_CONST, add_const)                       /* DXYN 7XNN  0.61% */ \
+    PAIR(OP_DRAW, draw, OP_SKIP_EQ_CONST, skip_eq_const)               /* DXYN 3XNN  0.55% */ \
+    PAIR(OP_ADD_CONST, add_const, OP_SKIP_NEQ_CONST, skip_neq_const)   /* 7XNN 4XNN  0.48% */ \
+    PAIR(OP_ASSIGN_CONST, assign_const, OP_SKIP_EQ_KEY, skip_eq_key)   /* 6XNN EX9E  0.45% */ \
+    PAIR(OP_DRAW, draw, OP_RET, ret)                                   /* DXYN 00EE  0.38% */ \
+    PAIR(OP_ASSIGN_CONST, assign_const, OP_ASSIGN_CONST, assign_const) /* 6XNN 6XNN  0.32% */ \
+    PAIR(OP_DRAW, draw, OP_RANDOM_NUMBER, random_number)               /* DXYN CXNN  0.29% */ \
+    PAIR(OP_ADD, add, OP_DRAW, draw)                                   /* 8XY4 DXYN  0.29% */ \
+
+#endif //FUSION_H
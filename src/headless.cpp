@@ -0,0 +1,97 @@
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8.h"
+#include "profile.h"
+#include "runner.h"
+
+const int DEFAULT_CYCLES_PER_TICK = 8;
+
+void print_state(Chip8& cpu);                   // Print the registers and display.
+
+int main(int argc, char *argv[]) {
+    // Parse command line arguments.
+    if (argc < 3) {
+        printf("Error: missing argument.\n");
+        printf("Usage: ./chip8_headless <path-to-rom> <num-cycles> [key-script|-] "
+                "[cycles-per-tick] [--jit|--threaded] [--trace <path-to-trace>] [--profile]\n");
+        return 1;
+    }
+
+    long num_cycles = atol(argv[2]);
+    int cycles_per_tick = argc > 4 ? atoi(argv[4]) : DEFAULT_CYCLES_PER_TICK;
+    if (num_cycles < 0 || cycles_per_tick <= 0) {
+        printf("Invalid number of cycles.\n");
+        return 1;
+    }
+
+    // Read the ROM and the key script.
+    std::vector<char> rom;
+    if (!read_file(argv[1], rom)) {
+        printf("Failed to load ROM.\n");
+        return 1;
+    }
+
+    std::vector<KeyEvent> events;
+    if (argc > 3 && strcmp(argv[3], "-") != 0 && !read_key_script(argv[3], events)) {
+        printf("Failed to load key script.\n");
+        return 1;
+    }
+
+    // Initialize the chip8 cpu and load the ROM.
+    Chip8 cpu;
+    const char* trace = NULL;
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0 && !cpu.set_engine(ENGINE_JIT)) {
+            printf("JIT engine is not supported on this platform.\n");
+            return 1;
+        } else if (strcmp(argv[i], "--threaded") == 0 && !cpu.set_engine(ENGINE_THREADED)) {
+            printf("Threaded engine is not supported by this compiler.\n");
+            return 1;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            cpu.set_profiling(true);
+        }
+    }
+    cpu.initialize();
+    cpu.load_rom(rom.data(), rom.size());
+
+    // Record the executed instructions.
+    if (trace != NULL && !cpu.start_trace(trace)) {
+        printf("Failed to create trace (tracing needs a build with CHIP8_TRACE).\n");
+        return 1;
+    }
+
+    // Run the session at maximum speed.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    run_session(cpu, num_cycles, cycles_per_tick, events);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    cpu.stop_trace();
+
+    print_state(cpu);
+    printf("Cycles: %ld\n", num_cycles);
+    printf("Idle cycles: %llu\n", (unsigned long long) cpu.get_idle_cycles());
+    printf("Time: %.6f s\n", elapsed.count());
+    printf("Cycles per second: %.0f\n", elapsed.count() > 0 ? num_cycles / elapsed.count() : 0.0);
+    if (cpu.get_profile() != NULL) {
+        print_profile(stdout, *cpu.get_profile(), cpu);
+    }
+
+    return 0;
+}
+
+void print_state(Chip8& cpu) {
+    printf("PC: 0x%03X I: 0x%03X\n", cpu.get_pc(), cpu.get_index());
+    for (int i = 0; i < REG_SIZE; i++) {
+        printf("V%X: 0x%02X%s", i, cpu.get_register(i), i % 8 == 7 ? "\n" : " ");
+    }
+
+    for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+        for (int x = 0; x < DISPLAY_WIDTH; x++) {
+            putchar(cpu.is_pixel(x, y) ? '#' : '.');
+        }
+        putchar('\n');
+    }
+}
@@ -0,0 +1,340 @@
+#include "jit.h"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+// Registers used by the generated code:
+const byte AL = 0;
+const byte CL = 1;
+
+#if defined(JIT_SUPPORTED)
+
+Jit::Jit() {
+    void* arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    arena_ = arena == MAP_FAILED ? NULL : (byte*) arena;
+    arena_used_ = 0;
+    blocks_run_ = 0;
+    flush();
+}
+
+Jit::~Jit() {
+    if (arena_ != NULL) {
+        munmap(arena_, JIT_ARENA_SIZE);
+    }
+}
+
+bool Jit::is_supported() { return true; }
+
+#else
+
+Jit::Jit()  { arena_ = NULL; arena_used_ = 0; blocks_run_ = 0; flush(); }
+Jit::~Jit() {}
+
+bool Jit::is_supported() { return false; }
+
+#endif
+
+// Execute num_cycles operations, running whole blocks when they fit in the
+// remaining cycles and falling back to the interpreter otherwise. A cpu waiting
+// for a key in FX0A stays halted for the remaining cycles.
+void Jit::run(Chip8* cpu, int num_cycles) {
+    while (num_cycles > 0 && !cpu->store_key_) {
+        word pc = cpu->pc_;
+        Block* block = NULL;
+        if (arena_ != NULL && pc < MEM_SIZE - 1) {
+            block = blocks_[pc].code != NULL ? &blocks_[pc] : compile(cpu, pc);
+        }
+
+        if (block != NULL && block->length <= num_cycles) {
+            block->code(cpu);
+            num_cycles -= block->length;
+            blocks_run_++;
+        } else {
+            cpu->step();
+            num_cycles--;
+        }
+    }
+}
+
+// Drop the blocks overlapping the len bytes written at address. The native code
+// itself is kept until the arena is recycled, since the block performing the
+// write may still be executing. Like the write, the range wraps around at the
+// end of memory.
+void Jit::invalidate(word address, int len) {
+    address &= MEM_SIZE - 1;
+    if (address + len > MEM_SIZE) {
+        invalidate(0, address + len - MEM_SIZE);
+        len = MEM_SIZE - address;
+    }
+
+    int first = address - 2 * JIT_MAX_BLOCK_LENGTH;
+    for (int i = first < 0 ? 0 : first; i < address + len && i < MEM_SIZE; i++) {
+        if (blocks_[i].code != NULL && blocks_[i].end > address) {
+            blocks_[i].code = NULL;
+        }
+    }
+}
+
+// Drop all blocks.
+void Jit::flush() {
+    for (int i = 0; i < MEM_SIZE; i++) {
+        blocks_[i].code = NULL;
+    }
+}
+
+uint64_t Jit::get_blocks_run() { return blocks_run_; }
+
+// Translate the basic block starting at address start.
+Jit::Block* Jit::compile(Chip8* cpu, word start) {
+    // Recycle the arena once it is full.
+    if (arena_used_ + JIT_MAX_BLOCK_SIZE > JIT_ARENA_SIZE) {
+        flush();
+        arena_used_ = 0;
+    }
+
+    V_offset_     = (byte*) &cpu->V_          - (byte*) cpu;
+    pc_offset_    = (byte*) &cpu->pc_         - (byte*) cpu;
+    I_offset_     = (byte*) &cpu->I_          - (byte*) cpu;
+    delay_offset_ = (byte*) &cpu->delay_timer_ - (byte*) cpu;
+
+    code_ = arena_ + arena_used_;
+    code_size_ = 0;
+
+    // Prologue: keep the Chip8 instance in rbx.
+    emit(0x53);                                 // push rbx
+    emit(0x48); emit(0x89); emit(0xFB);         // mov rbx, rdi
+
+    word pc = start;
+    int length = 0;
+    bool next = true;
+    while (next && length < JIT_MAX_BLOCK_LENGTH && pc < MEM_SIZE - 1) {
+        next = compile_operation(pc, cpu->operation(pc));
+        pc += 2;
+        length++;
+    }
+
+    // Straight-line blocks fall through to the next operation.
+    if (next) {
+        emit_pc(pc);
+    }
+
+    // Epilogue:
+    emit(0x5B);                                 // pop rbx
+    emit(0xC3);                                 // ret
+
+    arena_used_ += code_size_;
+
+    Block* block = &blocks_[start];
+    block->code   = (BlockCode) code_;
+    block->end    = pc;
+    block->length = length;
+    return block;
+}
+
+// Translate a single operation. Returns false if the operation ends the block.
+bool Jit::compile_operation(word pc, const Operation& op) {
+    int VX = V_offset_ + op.x;
+    int VY = V_offset_ + op.y;
+    int VF = V_offset_ + 0xF;
+
+    switch (op.op) {
+        // Invalid operation: do nothing.
+        case OP_NOP:
+            return true;
+
+        // 1NNN: Jump to address NNN.
+        case OP_JUMP:
+            emit_pc(op.nnn);
+            return false;
+
+        // 3XNN and 4XNN: Skips the next instruction if VX == NN (VX != NN).
+        case OP_SKIP_EQ_CONST:
+        case OP_SKIP_NEQ_CONST:
+            emit_mem(0x80, 7, VX); emit(op.nn);                 // cmp [VX], NN
+            emit(0xB8); emit32((word) (pc + 2));                // mov eax, pc + 2
+            emit(0xB9); emit32((word) (pc + 4));                // mov ecx, pc + 4
+            emit(0x0F); emit(op.op == OP_SKIP_EQ_CONST ? 0x44 : 0x45);  // cmove/cmovne
+            emit(0xC1);                                         // eax, ecx
+            emit(0x66); emit_mem(0x89, AL, pc_offset_);         // mov [pc], ax
+            return false;
+
+        // 5XY0 and 9XY0: Skips the next instruction if VX == VY (VX != VY).
+        case OP_SKIP_EQ:
+        case OP_SKIP_NEQ:
+            if (op.n != 0) {
+                emit_pc(pc + 2);
+                return false;
+            }
+            emit_mem(0x8A, AL, VX);                             // mov al, [VX]
+            emit_mem(0x3A, AL, VY);                             // cmp al, [VY]
+            emit(0xB8); emit32((word) (pc + 2));                // mov eax, pc + 2
+            emit(0xB9); emit32((word) (pc + 4));                // mov ecx, pc + 4
+            emit(0x0F); emit(op.op == OP_SKIP_EQ ? 0x44 : 0x45);        // cmove/cmovne
+            emit(0xC1);                                         // eax, ecx
+            emit(0x66); emit_mem(0x89, AL, pc_offset_);         // mov [pc], ax
+            return false;
+
+        // 6XNN: Set VX to NN.
+        case OP_ASSIGN_CONST:
+            emit_mem(0xC6, 0, VX); emit(op.nn);                 // mov [VX], NN
+            return true;
+
+        // 7XNN: Add NN to VX.
+        case OP_ADD_CONST:
+            emit_mem(0x80, 0, VX); emit(op.nn);                 // add [VX], NN
+            return true;
+
+        // 8XY0: Assign VY to VX.
+        case OP_ASSIGN:
+            emit_mem(0x8A, AL, VY);                             // mov al, [VY]
+            emit_mem(0x88, AL, VX);                             // mov [VX], al
+            return true;
+
+        // 8XY1, 8XY2 and 8XY3: Set VX to VX or/and/xor VY.
+        case OP_BITWISE_OR:
+        case OP_BITWISE_AND:
+        case OP_BITWISE_XOR:
+            emit_mem(0x8A, AL, VX);                             // mov al, [VX]
+            emit_mem(op.op == OP_BITWISE_OR  ? 0x0A :           // or  al, [VY]
+                     op.op == OP_BITWISE_AND ? 0x22 : 0x32,     // and al, [VY]
+                     AL, VY);                                   // xor al, [VY]
+            emit_mem(0x88, AL, VX);                             // mov [VX], al
+            return true;
+
+        // 8XY4: Adds VY to VX. VF is set before VX, exactly as the interpreter.
+        case OP_ADD:
+            emit_mem(0x8A, AL, VX);                             // mov al, [VX]
+            emit_mem(0x02, AL, VY);                             // add al, [VY]
+            emit(0x0F); emit(0x92); emit(0xC1);                 // setc cl
+            emit_mem(0x88, CL, VF);                             // mov [VF], cl
+            emit_mem(0x8A, AL, VX);                             // mov al, [VX]
+            emit_mem(0x02, AL, VY);                             // add al, [VY]
+            emit_mem(0x88, AL, VX);                             // mov [VX], al
+            return true;
+
+        // 8XY5: Sets VX to VX minus VY.
+        case OP_SUB:
+            emit_mem(0x8A, AL, VX);                             // mov al, [VX]
+            emit_mem(0x3A, AL, VY);                             // cmp al, [VY]
+            emit(0x0F); emit(0x93); emit(0xC1);                 // setae cl
+            emit_mem(0x88, CL, VF);                             // mov [VF], cl
+            emit_mem(0x8A, AL, VX);                             // mov al, [VX]
+            emit_mem(0x2A, AL, VY);                             // sub al, [VY]
+            emit_mem(0x88, AL, VX);                             // mov [VX], al
+            return true;
+
+        // 8XY6: Shift VX right by 1.
+        case OP_SHIFT_RIGHT:
+            emit_mem(0x8A, AL, VX);                             // mov al, [VX]
+            emit(0x24); emit(0x01);                             // and al, 1
+            emit_mem(0x88, AL, VF);                             // mov [VF], al
+            emit_mem(0xD0, 5, VX);                              // shr [VX], 1
+            return true;
+
+        // 8XY7: Sets VX to VY minus VX.
+        case OP_SUB_REVERSE:
+            emit_mem(0x8A, AL, VY);                             // mov al, [VY]
+            emit_mem(0x3A, AL, VX);                             // cmp al, [VX]
+            emit(0x0F); emit(0x93); emit(0xC1);                 // setae cl
+            emit_mem(0x88, CL, VF);                             // mov [VF], cl
+            emit_mem(0x8A, AL, VY);                             // mov al, [VY]
+            emit_mem(0x2A, AL, VX);                             // sub al, [VX]
+            emit_mem(0x88, AL, VX);                             // mov [VX], al
+            return true;
+
+        // 8XYE: Shift VX left by 1.
+        case OP_SHIFT_LEFT:
+            emit_mem(0x8A, AL, VX);                             // mov al, [VX]
+            emit(0xC0); emit(0xE8); emit(0x07);                 // shr al, 7
+            emit_mem(0x88, AL, VF);                             // mov [VF], al
+            emit_mem(0xD0, 4, VX);                              // shl [VX], 1
+            return true;
+
+        // ANNN: Sets I to the address NNN.
+        case OP_SET_INDEX:
+            emit(0x66); emit_mem(0xC7, 0, I_offset_); emit16(op.nnn); // mov [I], NNN
+            return true;
+
+        // FX07: Sets VX to the value of the delay timer.
+        case OP_GET_DELAY:
+            emit_mem(0x8A, AL, delay_offset_);                  // mov al, [delay]
+            emit_mem(0x88, AL, VX);                             // mov [VX], al
+            return true;
+
+        // FX15: Sets the delay timer to VX.
+        case OP_SET_DELAY:
+            emit_mem(0x8A, AL, VX);                             // mov al, [VX]
+            emit_mem(0x88, AL, delay_offset_);                  // mov [delay], al
+            return true;
+
+        // FX1E: Adds VX to I.
+        case OP_ADD_INDEX:
+            emit(0x0F); emit_mem(0xB6, AL, VX);                 // movzx eax, [VX]
+            emit(0x66); emit_mem(0x01, AL, I_offset_);          // add [I], ax
+            return true;
+
+        // FX29: Sets I to the location of the sprite for the character in VX.
+        case OP_SPRITE_ADDR:
+            emit(0x0F); emit_mem(0xB6, AL, VX);                 // movzx eax, [VX]
+            emit(0x8D); emit(0x04); emit(0x80);                 // lea eax, [rax + 4 * rax]
+            emit(0x66); emit_mem(0x89, AL, I_offset_);          // mov [I], ax
+            return true;
+
+        // Straight-line operations executed by the interpreter.
+        case OP_CLEAR:
+        case OP_RANDOM_NUMBER:
+        case OP_DRAW:
+        case OP_REG_LOAD:
+            emit_helper(pc);
+            return true;
+
+        // Operations executed by the interpreter which end the block: control
+        // flow, operations which may stall (FX0A, FX18) and operations which
+        // write memory and may thus invalidate the block itself (FX33, FX55).
+        default:
+            emit_helper(pc);
+            return false;
+    }
+}
+
+// Call the interpreter to execute the operation at pc.
+void Jit::emit_helper(word pc) {
+    emit_pc(pc);
+    emit(0x48); emit(0x89); emit(0xDF);                         // mov rdi, rbx
+    emit(0x48); emit(0xB8); emit64((unsigned long long) &exec_helper); // mov rax, helper
+    emit(0xFF); emit(0xD0);                                     // call rax
+}
+
+// Store pc in the program counter.
+void Jit::emit_pc(word pc) {
+    emit(0x66); emit_mem(0xC7, 0, pc_offset_); emit16(pc);      // mov [pc], pc
+}
+
+void Jit::emit(byte b) { code_[code_size_++] = b; }
+
+void Jit::emit16(word w) {
+    emit(w & 0xFF);
+    emit(w >> 8);
+}
+
+void Jit::emit32(unsigned int d) {
+    emit16(d & 0xFFFF);
+    emit16(d >> 16);
+}
+
+void Jit::emit64(unsigned long long q) {
+    emit32(q & 0xFFFFFFFF);
+    emit32(q >> 32);
+}
+
+// Encode an instruction with a [rbx + disp32] memory operand.
+void Jit::emit_mem(byte opcode, byte reg, int offset) {
+    emit(opcode);
+    emit(0x80 | (reg << 3) | 0x3);
+    emit32(offset);
+}
+
+void Jit::exec_helper(Chip8* cpu) { cpu->step(); }
@@ -0,0 +1,64 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "chip8.h"
+
+const int JIT_MAX_BLOCK_LENGTH = 32;        // Max number of operations per block.
+const int JIT_MAX_BLOCK_SIZE   = 64 * JIT_MAX_BLOCK_LENGTH; // Max bytes per block.
+const int JIT_ARENA_SIZE       = 1 << 20;   // Size of the executable arena.
+
+typedef void (*BlockCode)(Chip8* cpu);
+
+// Dynamic recompiler which translates straight-line basic blocks of CHIP-8
+// operations into native x86-64 code. Operations without a native translation
+// call back into the interpreter, so both engines are bit-exact.
+class Jit {
+    public:
+        Jit();
+        ~Jit();
+        static bool is_supported();
+        void run(Chip8* cpu, int num_cycles);   // Execute num_cycles operations.
+        void invalidate(word address, int len); // Drop blocks overlapping a write.
+        void flush();                           // Drop all blocks.
+        uint64_t get_blocks_run();              // Blocks executed as native code.
+    private:
+        Jit(const Jit& other);                  // Not copyable: owns the code arena.
+        Jit& operator=(const Jit& other);
+
+        // A translated basic block starting at some address:
+        struct Block {
+            BlockCode code;     // Native code, or NULL if not translated.
+            word end;           // Address following the last operation.
+            int length;         // Number of operations.
+        };
+
+        Block blocks_[MEM_SIZE];
+        uint64_t blocks_run_;
+
+        // Executable memory holding the native code:
+        byte* arena_;
+        int arena_used_;
+
+        // Native code emission:
+        byte* code_;
+        int code_size_;
+
+        Block* compile(Chip8* cpu, word start); // Translate the block at start.
+        bool compile_operation(word pc, const Operation& op);
+        void emit_helper(word pc);              // Call the interpreter at pc.
+        void emit_pc(word pc);                  // Store pc in the program counter.
+
+        // Encoding of x86-64 instructions:
+        void emit(byte b);
+        void emit16(word w);
+        void emit32(unsigned int d);
+        void emit64(unsigned long long q);
+        void emit_mem(byte opcode, byte reg, int offset);   // op reg, [rbx + offset]
+
+        // Offsets of the CPU state relative to the Chip8 instance:
+        int V_offset_, pc_offset_, I_offset_, delay_offset_;
+
+        static void exec_helper(Chip8* cpu);    // Interpret a single operation.
+};
+
+#endif //JIT_H
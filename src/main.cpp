@@ -1,20 +1,33 @@
 #include <SDL2/SDL.h>
-#include <SDL2/SDL_mixer.h>
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
+#include <mutex>
 #include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
 #include "chip8.h"
+#include "concurrent.h"
+#include "profile.h"
+#include "rewind.h"
+#include "scheduler.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // Display:
-const int SCALE = 10;
-const SDL_Color COLOR_BLACK = { 0x00, 0x00, 0x00, 0xFF };
-const SDL_Color COLOR_WHITE = { 0xFF, 0xFF, 0xFF, 0xFF };
+const int MIN_SCALE = 1;
+const int MAX_SCALE = 40;
+const Uint32 COLOR_BLACK = 0xFF000000;
+const Uint32 COLOR_WHITE = 0xFFFFFFFF;
 
-void setRenderDrawColor(SDL_Renderer* renderer, SDL_Color c) {
-    SDL_SetRenderDrawColor(renderer, c.r, c.g, c.b, c.a);
-}
+int scale = 10;
 
 SDL_Window* window = NULL;
 SDL_Renderer* renderer = NULL;
+SDL_Texture* texture = NULL;
 
 // Keypad:
 const int KEYMAP[16] = {
@@ -24,47 +37,100 @@ const int KEYMAP[16] = {
     SDLK_4, SDLK_r, SDLK_f, SDLK_v
 };
 
-const int KEY_INCREASE = SDLK_EQUALS;
-const int KEY_DECREASE = SDLK_MINUS;
+const int KEY_INCREASE  = SDLK_EQUALS;
+const int KEY_DECREASE  = SDLK_MINUS;
+const int KEY_ZOOM_IN   = SDLK_RIGHTBRACKET;
+const int KEY_ZOOM_OUT  = SDLK_LEFTBRACKET;
+const int KEY_REWIND    = SDLK_BACKSPACE;
 
-// Timing:
-const double MIN_CYCLES_PER_MS = 0.015625;
-const int MAX_SPEED            = 10;
-const int MIN_SPEED            = 1;
+// Timing, the number of cycles per second doubles with every speed step:
+const long MIN_CYCLES_PER_SECOND = 15;
+const int MAX_SPEED              = 10;
+const int MIN_SPEED              = 1;
 
-double cycles_per_ms;
-int speed = 6;
+std::atomic<int> speed(6);
 
-// Sound:
-const int SAMPLE_FREQUENCY = 22050;
-const int TONE_FREQUENCY   = 960;
-const int TONE_VOLUME      = 32;
-const int SOUND_VOLUME     = 32;
-const int MAX_SECONDS      = 5;
+// Sound, a square wave synthesized by the audio callback:
+const int SAMPLE_FREQUENCY     = 22050;
+const int TONE_FREQUENCY       = 960;
+const Sint16 TONE_AMPLITUDE    = 2048;
+const int AUDIO_BUFFER_SAMPLES = 256;   // Samples per callback, small for low latency.
 
-Uint8* audio_buffer = NULL;
-Mix_Chunk beep;
+SDL_AudioDeviceID audio_device = 0;
+int tone_samples_left = 0;              // Samples until the tone stops.
+int tone_phase = 0;                     // Samples into the current period.
 
-// CPU:
+// CPU, owned by the emulation thread once it runs:
 Chip8 cpu;
 
+// Rewind, one frame per update while the rewind key is held:
+Rewind history;
+std::atomic<bool> rewinding(false);
+
+// Communication between the emulation thread, the main thread which handles the
+// events and renders the display, and the audio thread which plays the sound:
+struct Frame {
+    uint64_t display[DISPLAY_HEIGHT];
+};
+
+struct KeyInput {
+    byte key;
+    bool pressed;
+};
+
+TripleBuffer<Frame> frames;             // Completed frames.
+SpscQueue<KeyInput, 64> key_inputs;     // Key presses and releases.
+SpscQueue<byte, 16> sounds;             // Durations of the sounds started.
+std::atomic<bool> running(true);
+
+// Wakes the emulation thread while the cpu is halted waiting for a key:
+std::mutex wake_mutex;
+std::condition_variable wake;
+
+// Completed frames are announced to the main thread by an event, so it sleeps in
+// SDL_WaitEvent until there is a frame to draw or an input event to handle:
+Uint32 frame_event = (Uint32) -1;
+std::atomic<bool> frame_pending(false); // A frame event is queued.
+
+uint64_t shown[DISPLAY_HEIGHT];         // Rows of the display on screen.
+
 bool initialize();                              // Start up SDL and create window.
 bool load_rom(char *path);                      // Load the ROM.
-void generate_sound();                          // Generate the sound samples.
+void synthesize(void* data, Uint8* stream, int len);    // Audio callback.
+void emulate();                                 // Run the emulation thread.
+void send_key(byte key, bool pressed);          // Pass a key to the emulation.
+void wake_emulation();                          // Wake the halted emulation.
 void handle_event(SDL_Event* event);            // Handle event.
 void draw_display(SDL_Renderer* renderer);      // Draw the display.
+void present_display(SDL_Renderer* renderer);   // Present the display texture.
+void expand_row(uint64_t row, Uint32* pixels);  // Expand a row to ARGB pixels.
+void set_scale(int value);                      // Resize the window.
 void close();                                   // Destroy the window and quit SDL.
 
 int main(int argc, char *argv[]) {
     // Parse command line arguments.
     if (argc < 2) {
         printf("Error: missing argument.\n");
-        printf("Usage: ./chip8_emulator <path-to-rom>\n");
+        printf("Usage: ./chip8_emulator <path-to-rom> [--jit|--threaded] [--profile]\n");
         return 1;
     }
 
+    // Select the execution engine and profiling.
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0 && !cpu.set_engine(ENGINE_JIT)) {
+            printf("JIT engine is not supported on this platform.\n");
+            return 1;
+        } else if (strcmp(argv[i], "--threaded") == 0 && !cpu.set_engine(ENGINE_THREADED)) {
+            printf("Threaded engine is not supported by this compiler.\n");
+            return 1;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            cpu.set_profiling(true);
+        }
+    }
+
     // Initialize the chip8 cpu and load the ROM.
     cpu.initialize();
+    cpu.seed(time(NULL));
     if (!load_rom(argv[1])) {
         printf("Failed to load ROM.\n");
         return 1;
@@ -76,63 +142,113 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Generate sound wave.
-    generate_sound();
+    // Run the emulation on its own thread, so rendering never stalls it.
+    std::thread emulation(emulate);
 
-    // Initialize variables.
-    cycles_per_ms = MIN_CYCLES_PER_MS * (1 << (speed - 1));
-    unsigned int last_cycle_time = SDL_GetTicks();
-    double last_update_time = SDL_GetTicks();
-    double num_cycles = 0.0;
-    int update_count = 0;
-
-    // Run the emulator.
+    // Sleep until an event arrives, at most once per timer tick for the frames.
     SDL_Event event;
-    while (true) {
-        // Handle events.
-        while (SDL_PollEvent(&event) != 0) {
-            if (event.type == SDL_QUIT) {
-                close();
-                return 0;
+    while (SDL_WaitEvent(&event) != 0 && event.type != SDL_QUIT) {
+        if (event.type == frame_event) {
+            // Show the newest completed frame.
+            frame_pending = false;
+            if (frames.update()) {
+                draw_display(renderer);
             }
-
+        } else {
             handle_event(&event);
         }
+    }
+
+    running = false;
+    wake_emulation();
+    emulation.join();
+    if (cpu.get_profile() != NULL) {
+        print_profile(stdout, *cpu.get_profile(), cpu);
+    }
+    close();
+
+    return 0;
+}
+
+void emulate() {
+    Scheduler scheduler;
+    while (running) {
+        // Apply the keys pressed and released since the last iteration.
+        KeyInput input;
+        while (key_inputs.pop(input)) {
+            cpu.set_key(input.key, input.pressed);
+        }
 
-        // Update the CPU.
-        unsigned int current_time = SDL_GetTicks();
-        num_cycles += (current_time - last_cycle_time) * cycles_per_ms;
-        last_cycle_time = current_time;
-        cpu.cycle(num_cycles);
+        // Run the ticks which are due: the cycles up to each tick and the tick,
+        // or one frame back while rewinding.
+        scheduler.set_speed(MIN_CYCLES_PER_SECOND << (speed - 1));
+        int num_ticks = scheduler.poll();
+        bool published = false;
+        for (int i = 0; i < num_ticks; i++) {
+            if (rewinding) {
+                history.rewind(cpu);
+                cpu.reset_sound_flag();
+            } else {
+                scheduler.run_ticks(cpu, 1);
+                history.record(cpu);
+            }
 
-        // Update the CPU's timers and the display at a rate of 60Hz.
-        while (SDL_GetTicks() > last_update_time + 16.667) {
-            // Redraw the display.
-            if (cpu.is_draw_flag()) {
-                draw_display(renderer);
+            // Publish the display if any row changed.
+            if (cpu.get_dirty_rows() != 0) {
+                Frame& frame = frames.get_back();
+                for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+                    frame.display[y] = cpu.get_row(y);
+                }
+                frames.publish();
+                cpu.reset_dirty_rows();
                 cpu.reset_draw_flag();
+                published = true;
             }
 
-            // Update the CPU's timers.
-            cpu.update_timers();
-            last_update_time += 16.667;
-            update_count++;
-
-            if (update_count == 60) {
-                last_update_time -= 0.02;
-                update_count = 0;
+            // Pass started sounds on; they are dropped when the queue is full.
+            if (cpu.is_sound_flag()) {
+                sounds.push(cpu.get_sound_duration());
+                cpu.reset_sound_flag();
             }
         }
 
-        // Play sound.
-        if (cpu.is_sound_flag()) {
-            beep.alen = (SAMPLE_FREQUENCY * cpu.get_sound_duration()) / 30;
-            Mix_PlayChannel(-1, &beep, 0);
-            cpu.reset_sound_flag();
+        // Wake the main thread to draw, unless a frame event is still queued.
+        if (published && !frame_pending.exchange(true)) {
+            SDL_Event event;
+            memset(&event, 0, sizeof(event));
+            event.type = frame_event;
+            SDL_PushEvent(&event);
         }
+
+        // A cpu halted waiting for a key changes nothing until one is pressed, so
+        // sleep until a key is sent instead of running empty ticks.
+        if (cpu.is_halted() && !rewinding) {
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            wake.wait(lock, [] { return !key_inputs.empty() || rewinding || !running; });
+            scheduler.start_clock();
+            continue;
+        }
+
+        // Nothing runs between ticks, so sleep until the next one.
+        std::this_thread::sleep_until(scheduler.get_next_tick_time());
     }
+}
 
-    return 0;
+void send_key(byte key, bool pressed) {
+    KeyInput input = { key, pressed };
+    while (!key_inputs.push(input)) {
+        std::this_thread::yield();
+    }
+    wake_emulation();
+}
+
+// Taking the lock orders the notification after the emulation thread checked
+// whether to sleep, so the wake-up cannot be lost.
+void wake_emulation() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+    }
+    wake.notify_one();
 }
 
 bool initialize() {
@@ -144,25 +260,64 @@ bool initialize() {
 
     // Create window.
     window = SDL_CreateWindow("Chip8", SDL_WINDOWPOS_UNDEFINED,
-            SDL_WINDOWPOS_UNDEFINED, SCALE * DISPLAY_WIDTH, SCALE * DISPLAY_HEIGHT,
-            SDL_WINDOW_SHOWN);
+            SDL_WINDOWPOS_UNDEFINED, scale * DISPLAY_WIDTH, scale * DISPLAY_HEIGHT,
+            SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
     if (window == NULL) {
         printf("Window could not be created. SDL_ERROR: %s\n", SDL_GetError());
         return false;
     }
 
+    // Register the event announcing frames.
+    frame_event = SDL_RegisterEvents(1);
+    if (frame_event == (Uint32) -1) {
+        printf("Frame event could not be registered. SDL_ERROR: %s\n", SDL_GetError());
+        return false;
+    }
+
     // Create renderer.
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    renderer = SDL_CreateRenderer(window, -1,
+            SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
     if (renderer == NULL) {
         printf("Renderer could not be created. SDL_ERROR: %s\n", SDL_GetError());
         return false;
     }
 
-    // Initialize SDL_mixer
-    if (Mix_OpenAudio(SAMPLE_FREQUENCY, MIX_DEFAULT_FORMAT, 1, 2048) < 0) {
-        printf("SDL_mixer could not initialize. SDL_mixer Error: %s\n", Mix_GetError());
+    // Create the display texture, which is scaled to the window when rendered.
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+            SDL_TEXTUREACCESS_STREAMING, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    if (texture == NULL) {
+        printf("Texture could not be created. SDL_ERROR: %s\n", SDL_GetError());
+        return false;
+    }
+
+    // Fill the texture with the blank display, which shown starts out as, since
+    // only rows differing from it are uploaded later. Present it right away.
+    void* pixels;
+    int pitch;
+    if (SDL_LockTexture(texture, NULL, &pixels, &pitch) != 0) {
+        printf("Texture could not be locked. SDL_ERROR: %s\n", SDL_GetError());
+        return false;
+    }
+    for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+        expand_row(shown[y], (Uint32*) ((Uint8*) pixels + y * pitch));
+    }
+    SDL_UnlockTexture(texture);
+    present_display(renderer);
+
+    // Open the audio device, SDL converts the samples if it needs another format.
+    SDL_AudioSpec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.freq = SAMPLE_FREQUENCY;
+    spec.format = AUDIO_S16SYS;
+    spec.channels = 1;
+    spec.samples = AUDIO_BUFFER_SAMPLES;
+    spec.callback = synthesize;
+    audio_device = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0);
+    if (audio_device == 0) {
+        printf("Audio device could not be opened. SDL_ERROR: %s\n", SDL_GetError());
         return false;
     }
+    SDL_PauseAudioDevice(audio_device, 0);
 
     return true;
 }
@@ -193,20 +348,26 @@ bool load_rom(char *path) {
     return false;
 }
 
-void generate_sound() {
-    int period = SAMPLE_FREQUENCY / TONE_FREQUENCY;
-    int half_period = 0.5 * period;
-    int num_samples = period * TONE_FREQUENCY * MAX_SECONDS;
-    Uint32 num_bytes = 2 * num_samples;
-    audio_buffer = new Uint8[num_bytes];
+// Fill the audio buffer. Every sound started by the emulation replaces the
+// current one and lasts exactly as long as its sound timer runs.
+void synthesize(void*, Uint8* stream, int len) {
+    byte duration;
+    while (sounds.pop(duration)) {
+        tone_samples_left = duration * SAMPLE_FREQUENCY / TICKS_PER_SECOND;
+    }
 
-    // Generate square wave.
+    Sint16* samples = (Sint16*) stream;
+    int num_samples = len / sizeof(Sint16);
+    int half_period = SAMPLE_FREQUENCY / TONE_FREQUENCY / 2;
     for (int i = 0; i < num_samples; i++) {
-        audio_buffer[2 * i]     = 0;
-        audio_buffer[2 * i + 1] = (i / half_period) % 2 ? TONE_VOLUME : -TONE_VOLUME;
+        if (tone_samples_left > 0) {
+            samples[i] = tone_phase < half_period ? TONE_AMPLITUDE : -TONE_AMPLITUDE;
+            tone_phase = (tone_phase + 1) % (2 * half_period);
+            tone_samples_left--;
+        } else {
+            samples[i] = 0;
+        }
     }
-
-    beep = {0, audio_buffer, num_bytes, SOUND_VOLUME};
 }
 
 void handle_event(SDL_Event* event) {
@@ -215,20 +376,31 @@ void handle_event(SDL_Event* event) {
             // Update CPU keypad.
             for (byte i = 0; i <= 0xF; i++) {
                 if (event->key.keysym.sym == KEYMAP[i]) {
-                    cpu.set_key(i, true);
+                    send_key(i, true);
                 }
             }
 
             // Increase the emulator speed if the increase key is pressed.
             if (event->key.keysym.sym == KEY_INCREASE) {
                 speed = speed < MAX_SPEED ? speed + 1 : MAX_SPEED;
-                cycles_per_ms = MIN_CYCLES_PER_MS * (1 << (speed - 1));
             }
 
             // Decrease the emulator speed if the decrease key is pressed.
             else if (event->key.keysym.sym == KEY_DECREASE) {
                 speed = speed > MIN_SPEED ? speed - 1 : MIN_SPEED;
-                cycles_per_ms = MIN_CYCLES_PER_MS * (1 << (speed - 1));
+            }
+
+            // Zoom the window in or out if the zoom keys are pressed.
+            else if (event->key.keysym.sym == KEY_ZOOM_IN) {
+                set_scale(scale + 1);
+            } else if (event->key.keysym.sym == KEY_ZOOM_OUT) {
+                set_scale(scale - 1);
+            }
+
+            // Rewind the session while the rewind key is held.
+            else if (event->key.keysym.sym == KEY_REWIND) {
+                rewinding = true;
+                wake_emulation();
             }
 
             break;
@@ -237,43 +409,93 @@ void handle_event(SDL_Event* event) {
             // Update CPU keypad.
             for (byte i = 0; i <= 0xF; i++) {
                 if (event->key.keysym.sym == KEYMAP[i]) {
-                    cpu.set_key(i, false);
+                    send_key(i, false);
                 }
+            }
+
+            // Continue the session from the rewound frame.
+            if (event->key.keysym.sym == KEY_REWIND) {
+                rewinding = false;
             } break;
+
+        case SDL_WINDOWEVENT:
+            // The texture is stretched to the new window size for free.
+            present_display(renderer);
+            break;
     }
 }
 
 void draw_display(SDL_Renderer* renderer) {
-    // Clear the screen.
-    setRenderDrawColor(renderer, COLOR_BLACK);
-    SDL_RenderClear(renderer);
+    // Frames may have been skipped, so compare against the rows on screen.
+    const Frame& frame = frames.get_front();
+    uint32_t dirty_rows = 0;
+    for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+        dirty_rows |= (uint32_t) (frame.display[y] != shown[y]) << y;
+        shown[y] = frame.display[y];
+    }
+    if (dirty_rows == 0) {
+        return;
+    }
 
-    // Draw all pixels on the display.
-    setRenderDrawColor(renderer, COLOR_WHITE);
-    for (int x = 0; x < DISPLAY_WIDTH; x++) {
-        for (int y = 0; y < DISPLAY_HEIGHT; y++) {
-            if (cpu.is_pixel(x, y)) {
-                SDL_Rect pixel = {SCALE * x, SCALE * y, SCALE, SCALE};
-                SDL_RenderFillRect(renderer, &pixel);
-            }
+    // Lock the span of dirty rows and refill it from the display. The locked
+    // pixels are write-only, so clean rows inside the span are refilled too.
+    int first = 0, last = DISPLAY_HEIGHT - 1;
+    while (((dirty_rows >> first) & 1) == 0) { first++; }
+    while (((dirty_rows >> last) & 1) == 0) { last--; }
+    SDL_Rect rect = {0, first, DISPLAY_WIDTH, last - first + 1};
+    void* pixels;
+    int pitch;
+    if (SDL_LockTexture(texture, &rect, &pixels, &pitch) == 0) {
+        for (int y = first; y <= last; y++) {
+            expand_row(shown[y], (Uint32*) ((Uint8*) pixels + (y - first) * pitch));
         }
+        SDL_UnlockTexture(texture);
     }
 
-    // Present the result on screen.
+    present_display(renderer);
+}
+
+void present_display(SDL_Renderer* renderer) {
+    // Scale the texture to the window and present the result on screen.
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
 }
 
+void expand_row(uint64_t row, Uint32* pixels) {
+#if defined(__SSE2__)
+    // Expand four pixels at a time: compare a broadcast nibble against one bit
+    // per lane, which yields white for set pixels once black is or-ed in.
+    const __m128i bits  = _mm_set_epi32(0x1, 0x2, 0x4, 0x8);
+    const __m128i black = _mm_set1_epi32(COLOR_BLACK);
+    for (int x = 0; x < DISPLAY_WIDTH; x += 4) {
+        __m128i nibble = _mm_set1_epi32((row >> (60 - x)) & 0xF);
+        __m128i set = _mm_cmpeq_epi32(_mm_and_si128(nibble, bits), bits);
+        _mm_storeu_si128((__m128i*) (pixels + x), _mm_or_si128(set, black));
+    }
+#else
+    for (int x = 0; x < DISPLAY_WIDTH; x++) {
+        pixels[x] = (row >> (63 - x)) & 0x1 ? COLOR_WHITE : COLOR_BLACK;
+    }
+#endif
+}
+
+void set_scale(int value) {
+    scale = value < MIN_SCALE ? MIN_SCALE : value > MAX_SCALE ? MAX_SCALE : value;
+    SDL_SetWindowSize(window, scale * DISPLAY_WIDTH, scale * DISPLAY_HEIGHT);
+}
+
 void close() {
-    // Delete audio buffer.
-    delete[] audio_buffer;
+    // Stop the audio.
+    SDL_CloseAudioDevice(audio_device);
 
-    // Delete window and renderer.
+    // Delete texture, window and renderer.
+    SDL_DestroyTexture(texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
+    texture = NULL;
     renderer = NULL;
     window = NULL;
 
     // Quit SDL subsystems.
-    Mix_Quit();
     SDL_Quit();
 }
@@ -0,0 +1,147 @@
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "profile.h"
+#include "runner.h"
+
+const long ROM_CYCLES           = 1000000;
+const int CYCLES_PER_TICK       = 8;
+const long KEY_INTERVAL         = 20000;    // Cycles between scripted key presses.
+const long KEY_HOLD             = 2000;     // Cycles a scripted key is held.
+const int DEFAULT_NUM_PAIRS     = 12;
+
+// Names of the instructions and their handlers in chip8.h, used in the table:
+const char* const OP_IDS[NUM_OPS] = {
+    "OP_NOP", "OP_CLEAR", "OP_RET", "OP_JUMP", "OP_CALL", "OP_SKIP_EQ_CONST",
+    "OP_SKIP_NEQ_CONST", "OP_SKIP_EQ", "OP_ASSIGN_CONST", "OP_ADD_CONST", "OP_ASSIGN",
+    "OP_BITWISE_OR", "OP_BITWISE_AND", "OP_BITWISE_XOR", "OP_ADD", "OP_SUB",
+    "OP_SHIFT_RIGHT", "OP_SUB_REVERSE", "OP_SHIFT_LEFT", "OP_SKIP_NEQ", "OP_SET_INDEX",
+    "OP_JUMP_OFFSET", "OP_RANDOM_NUMBER", "OP_DRAW", "OP_SKIP_EQ_KEY", "OP_SKIP_NEQ_KEY",
+    "OP_GET_DELAY", "OP_GET_KEY", "OP_SET_DELAY", "OP_SET_SOUND", "OP_ADD_INDEX",
+    "OP_SPRITE_ADDR", "OP_BCD", "OP_REG_DUMP", "OP_REG_LOAD"
+};
+const char* const HANDLERS[NUM_OPS] = {
+    "nop", "clear", "ret", "jump", "call", "skip_eq_const", "skip_neq_const", "skip_eq",
+    "assign_const", "add_const", "assign", "bitwise_or", "bitwise_and", "bitwise_xor",
+    "add", "sub", "shift_right", "sub_reverse", "shift_left", "skip_neq", "set_index",
+    "jump_offset", "random_number", "draw", "skip_eq_key", "skip_neq_key", "get_delay",
+    "get_key", "set_delay", "set_sound", "add_index", "sprite_addr", "bcd", "reg_dump",
+    "reg_load"
+};
+
+// A pair of adjacent instructions and its share of the executed instructions.
+struct Pair {
+    int first, second;
+    double share;
+};
+
+// Order pairs by descending share, then by instruction, so the table is stable.
+bool by_share(const Pair& a, const Pair& b) {
+    if (a.share != b.share) {
+        return a.share > b.share;
+    }
+    return a.first != b.first ? a.first < b.first : a.second < b.second;
+}
+
+std::vector<KeyEvent> build_key_script();      // Press every key in turn.
+
+int main(int argc, char *argv[]) {
+    // Parse command line arguments.
+    int num_pairs = argc > 2 ? atoi(argv[2]) : DEFAULT_NUM_PAIRS;
+    if (argc < 2 || num_pairs <= 0) {
+        printf("Usage: ./chip8_mine <rom-directory> [num-pairs] > fusion.h\n");
+        return 1;
+    }
+
+    std::vector<std::string> roms;
+    if (!list_roms(argv[1], roms) || roms.empty()) {
+        printf("Failed to read ROM directory.\n");
+        return 1;
+    }
+
+    // Run every ROM with the profiler, adding up the share of each pair of
+    // instructions in its executed instructions, so every ROM weighs the same.
+    const std::vector<KeyEvent> events = build_key_script();
+    std::vector<double> shares(NUM_OPS * NUM_OPS, 0.0);
+    for (size_t i = 0; i < roms.size(); i++) {
+        std::vector<char> rom;
+        if (!read_file((std::string(argv[1]) + "/" + roms[i]).c_str(), rom)) {
+            printf("Failed to load ROM %s.\n", roms[i].c_str());
+            return 1;
+        }
+
+        Chip8 cpu;
+        cpu.initialize();
+        cpu.seed(0);
+        cpu.load_rom(rom.data(), rom.size());
+        cpu.set_profiling(true);
+        run_session(cpu, ROM_CYCLES, CYCLES_PER_TICK, events);
+
+        const Profile& profile = *cpu.get_profile();
+        for (int first = 0; first < NUM_OPS; first++) {
+            for (int second = 0; second < NUM_OPS; second++) {
+                shares[first * NUM_OPS + second] += (double) profile.pairs[first][second] /
+                        profile.cycles / roms.size();
+            }
+        }
+    }
+
+    // Keep the pairs the interpreter can fuse.
+    std::vector<Pair> pairs;
+    for (int first = 0; first < NUM_OPS; first++) {
+        for (int second = 0; second < NUM_OPS; second++) {
+            if (Chip8::can_fuse(first) && shares[first * NUM_OPS + second] > 0) {
+                Pair pair = { first, second, shares[first * NUM_OPS + second] };
+                pairs.push_back(pair);
+            }
+        }
+    }
+    std::sort(pairs.begin(), pairs.end(), by_share);
+    if (pairs.size() > (size_t) num_pairs) {
+        pairs.resize(num_pairs);
+    }
+
+    // Write the table.
+    printf("// Generated by chip8_mine from the %d ROMs in roms/, do not edit. To regenerate:\n",
+            (int) roms.size());
+    printf("//\n");
+    printf("//     ./chip8_mine ../roms %d > ../src/fusion.h\n", num_pairs);
+    printf("//\n");
+    printf("// The pairs of adjacent instructions executed most, which the interpreter runs\n");
+    printf("// with a fused handler, and their share of the executed instructions averaged\n");
+    printf("// over the ROMs.\n");
+    printf("#ifndef FUSION_H\n");
+    printf("#define FUSION_H\n");
+    printf("\n");
+    printf("#define FUSED_PAIRS(PAIR) \\\n");
+    for (size_t i = 0; i < pairs.size(); i++) {
+        const Pair& pair = pairs[i];
+        std::string entry = std::string("PAIR(") + OP_IDS[pair.first] + ", " +
+                HANDLERS[pair.first] + ", " + OP_IDS[pair.second] + ", " +
+                HANDLERS[pair.second] + ")";
+        printf("    %-66s /* %s %s %5.2f%% */ \\\n", entry.c_str(), OP_NAMES[pair.first],
+                OP_NAMES[pair.second], 100.0 * pair.share);
+    }
+    printf("\n");
+    printf("#endif //FUSION_H\n");
+
+    return 0;
+}
+
+// Many ROMs wait for a key before they start, so every key is pressed in turn
+// for a while, the same way for every ROM.
+std::vector<KeyEvent> build_key_script() {
+    std::vector<KeyEvent> events;
+    for (long cycle = KEY_INTERVAL; cycle < ROM_CYCLES; cycle += KEY_INTERVAL) {
+        byte key = (cycle / KEY_INTERVAL) % NUM_KEYS;
+        KeyEvent press = { cycle, key, true };
+        KeyEvent release = { cycle + KEY_HOLD, key, false };
+        events.push_back(press);
+        events.push_back(release);
+    }
+    return events;
+}
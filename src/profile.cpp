@@ -0,0 +1,63 @@
+#include <algorithm>
+#include <vector>
+#include "profile.h"
+
+const char* const OP_NAMES[NUM_OPS] = {
+    "0NNN", "00E0", "00EE", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN",
+    "7XNN", "8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6", "8XY7",
+    "8XYE", "9XY0", "ANNN", "BNNN", "CXNN", "DXYN", "EX9E", "EXA1", "FX07",
+    "FX0A", "FX15", "FX18", "FX1E", "FX29", "FX33", "FX55", "FX65"
+};
+
+// Order indices by descending count.
+struct ByCount {
+    const uint64_t* counts;
+    bool operator()(int a, int b) const { return counts[a] > counts[b]; }
+};
+
+void print_profile(FILE* file, const Profile& profile, Chip8& cpu) {
+    double cycles = profile.cycles > 0 ? profile.cycles : 1;
+    double waited = profile.key_wait_seconds;
+    if (profile.waiting) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() -
+                profile.wait_start;
+        waited += elapsed.count();
+    }
+
+    fprintf(file, "Profile: %llu cycles\n", (unsigned long long) profile.cycles);
+    fprintf(file, "Waiting for a key (FX0A): %llu cycles (%.1f%%), %.3f s\n",
+            (unsigned long long) profile.key_wait_cycles,
+            100.0 * profile.key_wait_cycles / cycles, waited);
+
+    // Instructions, most executed first.
+    std::vector<int> ops;
+    for (int i = 0; i < NUM_OPS; i++) {
+        if (profile.ops[i] > 0) {
+            ops.push_back(i);
+        }
+    }
+    ByCount by_op = { profile.ops };
+    std::stable_sort(ops.begin(), ops.end(), by_op);
+    fprintf(file, "Instructions:\n");
+    for (size_t i = 0; i < ops.size(); i++) {
+        fprintf(file, "  %s %12llu %5.1f%%\n", OP_NAMES[ops[i]],
+                (unsigned long long) profile.ops[ops[i]], 100.0 * profile.ops[ops[i]] / cycles);
+    }
+
+    // Hottest addresses.
+    std::vector<int> pcs;
+    for (int i = 0; i < MEM_SIZE; i++) {
+        if (profile.pcs[i] > 0) {
+            pcs.push_back(i);
+        }
+    }
+    ByCount by_pc = { profile.pcs };
+    std::stable_sort(pcs.begin(), pcs.end(), by_pc);
+    fprintf(file, "Addresses:\n");
+    for (size_t i = 0; i < pcs.size() && i < (size_t) PROFILE_HOT_PCS; i++) {
+        int pc = pcs[i];
+        fprintf(file, "  %03X %02X%02X %12llu %5.1f%%\n", pc, cpu.get_memory(pc),
+                cpu.get_memory(pc + 1), (unsigned long long) profile.pcs[pc],
+                100.0 * profile.pcs[pc] / cycles);
+    }
+}
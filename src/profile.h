@@ -0,0 +1,34 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <chrono>
+#include <stdio.h>
+#include "chip8.h"
+
+const int PROFILE_HOT_PCS = 16;     // Addresses listed in the report.
+
+// Execution counts gathered by an instance while profiling.
+struct Profile {
+    uint64_t cycles;                // Operations executed.
+    uint64_t ops[NUM_OPS];          // Executions per instruction.
+    uint64_t pcs[MEM_SIZE];         // Executions per address.
+    uint64_t pairs[NUM_OPS][NUM_OPS];   // Executions per instruction (second
+                                        // index) right after the instruction
+                                        // before it in memory (first index).
+    word last_pc;                   // Address of the last operation executed,
+    byte last_op;                   // and its instruction.
+    uint64_t key_wait_cycles;       // Cycles spent in FX0A waiting for a key.
+    double key_wait_seconds;        // Real time spent waiting for a key.
+
+    // Start of the current wait for a key:
+    bool waiting;
+    std::chrono::steady_clock::time_point wait_start;
+};
+
+extern const char* const OP_NAMES[NUM_OPS];    // Opcode pattern per instruction.
+
+// Print the instructions and the addresses executed most, with the opcode found
+// at each address in the memory of the cpu.
+void print_profile(FILE* file, const Profile& profile, Chip8& cpu);
+
+#endif //PROFILE_H
@@ -0,0 +1,144 @@
+#include "rewind.h"
+
+// A run of this many zero bytes ends a literal run of the encoding.
+const int MIN_ZERO_RUN = 3;
+
+Rewind::Rewind(size_t budget) : buffer_(budget) {
+    // Zero the padding of the snapshots, so it never shows up in a delta.
+    memset(&current_, 0, sizeof(current_));
+    memset(&next_, 0, sizeof(next_));
+    clear();
+}
+
+void Rewind::clear() {
+    has_current_ = false;
+    head_ = used_ = 0;
+    frames_.clear();
+}
+
+int Rewind::get_num_frames() { return frames_.size(); }
+size_t Rewind::get_size()    { return used_; }
+
+void Rewind::record(Chip8& cpu) {
+    cpu.save_state(next_);
+    if (has_current_) {
+        encode(current_, next_);
+        push();
+    }
+    memcpy(&current_, &next_, sizeof(current_));
+    has_current_ = true;
+}
+
+// Step back one frame by applying the newest delta to the newest state. Returns
+// false, leaving the cpu untouched, once the oldest frame has been reached.
+bool Rewind::rewind(Chip8& cpu) {
+    if (frames_.empty()) {
+        return false;
+    }
+
+    pop();
+    decode(current_);
+    cpu.load_state(current_);
+    return true;
+}
+
+// The delta is a sequence of runs, each a varint count of unchanged bytes, a
+// varint count of changed bytes and the changed bytes XOR-ed with the old
+// value. Trailing unchanged bytes are omitted.
+void Rewind::encode(const Chip8State& a, const Chip8State& b) {
+    const byte* x = (const byte*) &a;
+    const byte* y = (const byte*) &b;
+    const size_t size = sizeof(Chip8State);
+    delta_.clear();
+
+    size_t i = 0;
+    while (i < size) {
+        size_t start = i;
+        while (i < size && x[i] == y[i]) {
+            i++;
+        }
+        if (i == size) {
+            break;
+        }
+
+        // The literal run ends at the next run of unchanged bytes.
+        size_t literal = i, zeros = 0;
+        while (i < size && zeros < MIN_ZERO_RUN) {
+            zeros = x[i] == y[i] ? zeros + 1 : 0;
+            i++;
+        }
+        i -= zeros;
+
+        put_varint(literal - start);
+        put_varint(i - literal);
+        for (size_t j = literal; j < i; j++) {
+            delta_.push_back(x[j] ^ y[j]);
+        }
+    }
+}
+
+void Rewind::decode(Chip8State& state) {
+    byte* x = (byte*) &state;
+    size_t pos = 0, i = 0;
+    while (pos < delta_.size()) {
+        i += get_varint(delta_.data(), pos);
+        size_t length = get_varint(delta_.data(), pos);
+        for (size_t j = 0; j < length; j++) {
+            x[i++] ^= delta_[pos++];
+        }
+    }
+}
+
+void Rewind::push() {
+    size_t size = delta_.size();
+    if (size >= buffer_.size()) {
+        // A single frame which does not fit breaks the chain of deltas.
+        head_ = used_ = 0;
+        frames_.clear();
+        return;
+    }
+
+    // Drop the oldest frames to make room.
+    while (used_ + size > buffer_.size() || frames_.size() >= MAX_REWIND_FRAMES) {
+        used_ -= frames_.front();
+        frames_.pop_front();
+    }
+
+    size_t first = size < buffer_.size() - head_ ? size : buffer_.size() - head_;
+    memcpy(&buffer_[head_], delta_.data(), first);
+    memcpy(&buffer_[0], delta_.data() + first, size - first);
+    head_ = (head_ + size) % buffer_.size();
+    used_ += size;
+    frames_.push_back(size);
+}
+
+void Rewind::pop() {
+    size_t size = frames_.back();
+    size_t start = (head_ + buffer_.size() - size) % buffer_.size();
+    size_t first = size < buffer_.size() - start ? size : buffer_.size() - start;
+    delta_.resize(size);
+    memcpy(delta_.data(), &buffer_[start], first);
+    memcpy(delta_.data() + first, &buffer_[0], size - first);
+    head_ = start;
+    used_ -= size;
+    frames_.pop_back();
+}
+
+void Rewind::put_varint(size_t value) {
+    while (value >= 0x80) {
+        delta_.push_back((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    delta_.push_back(value);
+}
+
+size_t Rewind::get_varint(const byte* data, size_t& pos) {
+    size_t value = 0;
+    for (int shift = 0; ; shift += 7) {
+        byte b = data[pos++];
+        value |= (size_t) (b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return value;
+        }
+    }
+}
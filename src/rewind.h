@@ -0,0 +1,43 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <deque>
+#include <vector>
+#include "chip8.h"
+
+const size_t DEFAULT_REWIND_BUDGET = 8 << 20;       // Bytes of history.
+const size_t MAX_REWIND_FRAMES     = 60 * 60 * 10;  // Ten minutes at 60 frames/s.
+
+// History of machine states, one per frame, for rewinding a session. Only the
+// newest state is kept in full; each older frame is stored as the XOR against
+// its successor, run-length encoded, in a ring buffer of bounded size. When the
+// buffer is full the oldest frames are dropped.
+class Rewind {
+    public:
+        Rewind(size_t budget = DEFAULT_REWIND_BUDGET);
+        void record(Chip8& cpu);    // Record the state of the current frame.
+        bool rewind(Chip8& cpu);    // Restore the previous frame, if any.
+        void clear();               // Drop all history.
+        int get_num_frames();       // Number of frames which can be rewound.
+        size_t get_size();          // Bytes of history in use.
+    private:
+        // Newest recorded state, and the next one being recorded:
+        Chip8State current_, next_;
+        bool has_current_;
+
+        // Ring buffer holding the encoded deltas, newest at the head:
+        std::vector<byte> buffer_;
+        size_t head_, used_;
+        std::deque<size_t> frames_; // Sizes of the deltas, oldest first.
+
+        std::vector<byte> delta_;   // Scratch space for encoding and decoding.
+
+        void encode(const Chip8State& a, const Chip8State& b); // RLE of a ^ b.
+        void decode(Chip8State& state);                         // Apply delta_.
+        void push();                // Append delta_ to the ring buffer.
+        void pop();                 // Move the newest delta to delta_.
+        void put_varint(size_t value);
+        static size_t get_varint(const byte* data, size_t& pos);
+};
+
+#endif //REWIND_H
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <dirent.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include "runner.h"
+
+bool read_file(const char* path, std::vector<char>& data) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// List the regular files in a directory, sorted by name.
+bool list_roms(const char* path, std::vector<std::string>& roms) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return false;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat info;
+        std::string file = std::string(path) + "/" + entry->d_name;
+        if (stat(file.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+            roms.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    std::sort(roms.begin(), roms.end());
+    return true;
+}
+
+// Each line of a key script holds the cycle, the key (0-F) and 1 for a press or
+// 0 for a release. Empty lines and lines starting with # are ignored.
+bool read_key_script(const char* path, std::vector<KeyEvent>& events) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        long cycle;
+        int key, pressed;
+        if (!(fields >> cycle >> std::hex >> key >> std::dec >> pressed) ||
+                key < 0 || key >= NUM_KEYS) {
+            return false;
+        }
+
+        KeyEvent event = { cycle, (byte) key, pressed != 0 };
+        events.push_back(event);
+    }
+
+    return true;
+}
+
+void run_session(Chip8& cpu, long num_cycles, int cycles_per_tick,
+        const std::vector<KeyEvent>& events) {
+    Scheduler scheduler(cycles_per_tick * TICKS_PER_SECOND);
+    size_t next_event = 0;
+
+    while (scheduler.get_cycles() < num_cycles) {
+        // Apply the key events which are due.
+        long cycles = scheduler.get_cycles();
+        while (next_event < events.size() && events[next_event].cycle <= cycles) {
+            cpu.set_key(events[next_event].key, events[next_event].pressed);
+            next_event++;
+        }
+
+        // Run until the next timer tick, key event or the end of the session.
+        long until = scheduler.get_next_tick() < num_cycles ? scheduler.get_next_tick()
+                : num_cycles;
+        if (next_event < events.size() && events[next_event].cycle < until) {
+            until = events[next_event].cycle;
+        }
+        long ticks = scheduler.get_ticks();
+        scheduler.run(cpu, until - cycles);
+
+        // There is no audio, so the sound is consumed at once.
+        if (scheduler.get_ticks() != ticks) {
+            cpu.reset_sound_flag();
+        }
+    }
+}
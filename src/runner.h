@@ -0,0 +1,26 @@
+#ifndef RUNNER_H
+#define RUNNER_H
+
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "scheduler.h"
+
+// Scripted key input: the key is pressed or released once the given number of
+// cycles has been executed.
+struct KeyEvent {
+    long cycle;
+    byte key;
+    bool pressed;
+};
+
+bool read_file(const char* path, std::vector<char>& data);            // Read a file.
+bool read_key_script(const char* path, std::vector<KeyEvent>& events); // Read keys.
+bool list_roms(const char* path, std::vector<std::string>& roms);      // List files.
+
+// Run num_cycles cycles without wall-clock pacing. The timers are updated every
+// cycles_per_tick cycles and the key events, sorted by cycle, are applied on time.
+void run_session(Chip8& cpu, long num_cycles, int cycles_per_tick,
+        const std::vector<KeyEvent>& events);
+
+#endif //RUNNER_H
@@ -0,0 +1,80 @@
+#include "scheduler.h"
+
+Scheduler::Scheduler(long cycles_per_second) : cycles_per_second_(cycles_per_second),
+        cycles_(0), ticks_(0), last_tick_(0), remainder_(0) {
+    next_tick_ = (remainder_ + cycles_per_second_) / TICKS_PER_SECOND;
+    start_clock();
+}
+
+// Change the number of cycles per second, starting with the cycles of the next
+// tick. Cycles of that tick which already ran are not undone.
+void Scheduler::set_speed(long cycles_per_second) {
+    cycles_per_second_ = cycles_per_second;
+    next_tick_ = last_tick_ + (remainder_ + cycles_per_second_) / TICKS_PER_SECOND;
+    if (next_tick_ < cycles_) {
+        next_tick_ = cycles_;
+    }
+}
+
+long Scheduler::get_speed() { return cycles_per_second_; }
+long Scheduler::get_cycles() { return cycles_; }
+long Scheduler::get_ticks() { return ticks_; }
+long Scheduler::get_next_tick() { return next_tick_; }
+
+// Run until the given number of cycles has been executed. Every tick which falls
+// within them, or at their end, is run as soon as the cycles before it are done.
+void Scheduler::run(Chip8& cpu, long num_cycles) {
+    long end = cycles_ + num_cycles;
+    while (cycles_ < end) {
+        long until = next_tick_ < end ? next_tick_ : end;
+        cpu.cycle(until - cycles_);
+        cycles_ = until;
+
+        while (cycles_ == next_tick_) {
+            tick(cpu);
+        }
+    }
+}
+
+void Scheduler::run_ticks(Chip8& cpu, int num_ticks) {
+    for (int i = 0; i < num_ticks; i++) {
+        cpu.cycle(next_tick_ - cycles_);
+        cycles_ = next_tick_;
+        tick(cpu);
+    }
+}
+
+// Update the timers and find the cycle of the next tick.
+void Scheduler::tick(Chip8& cpu) {
+    cpu.update_timers();
+    ticks_++;
+
+    remainder_ = (remainder_ + cycles_per_second_) % TICKS_PER_SECOND;
+    last_tick_ = next_tick_;
+    next_tick_ = last_tick_ + (remainder_ + cycles_per_second_) / TICKS_PER_SECOND;
+}
+
+void Scheduler::start_clock() {
+    start_ = std::chrono::steady_clock::now();
+    clock_ticks_ = 0;
+}
+
+// Return the number of ticks which came due since the last call. Ticks are due at
+// fixed times after the start, so the pacing does not drift. When the caller fell
+// far behind (for example while the process was suspended) the oldest ticks are
+// dropped instead of being run all at once.
+int Scheduler::poll() {
+    std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start_;
+    long due = elapsed.count() * TICKS_PER_SECOND / 1000000000LL;
+    if (due - clock_ticks_ > MAX_TICKS_BEHIND) {
+        clock_ticks_ = due - MAX_TICKS_BEHIND;
+    }
+
+    int num_ticks = due - clock_ticks_;
+    clock_ticks_ = due;
+    return num_ticks;
+}
+
+std::chrono::steady_clock::time_point Scheduler::get_next_tick_time() {
+    return start_ + std::chrono::nanoseconds((clock_ticks_ + 1) * 1000000000LL / TICKS_PER_SECOND);
+}
@@ -0,0 +1,44 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <chrono>
+#include "chip8.h"
+
+const int TICKS_PER_SECOND            = 60;  // Rate of the delay and sound timers.
+const long DEFAULT_CYCLES_PER_SECOND  = 480;
+const int MAX_TICKS_BEHIND            = 6;   // Ticks caught up at once before skipping.
+
+// Interleaves the execution of instructions with the 60Hz timer ticks at an exact
+// ratio of cycles per second. Cycles are counted in integers: the fraction of a
+// cycle left over at each tick is carried to the next one, so any number of ticks
+// runs exactly the cycles due and nothing drifts. Running cycles does not depend
+// on the clock, which is only read by poll() to find the ticks due in real time.
+class Scheduler {
+    public:
+        Scheduler(long cycles_per_second = DEFAULT_CYCLES_PER_SECOND);
+        void set_speed(long cycles_per_second);
+        long get_speed();
+        void run(Chip8& cpu, long num_cycles);      // Run cycles, ticking on time.
+        void run_ticks(Chip8& cpu, int num_ticks);  // Run up to and including ticks.
+        long get_cycles();                          // Cycles run so far.
+        long get_ticks();                           // Ticks run so far.
+        long get_next_tick();                       // Cycles run at the next tick.
+
+        // Real-time pacing:
+        void start_clock();                         // Tick zero is now.
+        int poll();                                 // Take the ticks due by now.
+        std::chrono::steady_clock::time_point get_next_tick_time();
+    private:
+        long cycles_per_second_;
+        long cycles_, ticks_;
+        long last_tick_;        // Cycle count at which the last tick ran.
+        long next_tick_;        // Cycle count at which the next tick is due.
+        long remainder_;        // Fraction of a cycle carried over, in 1/60 cycles.
+
+        std::chrono::steady_clock::time_point start_;
+        long clock_ticks_;      // Ticks taken by poll() since start_.
+
+        void tick(Chip8& cpu);
+};
+
+#endif //SCHEDULER_H
@@ -0,0 +1,248 @@
+#include <chrono>
+#include <fstream>
+#include <new>
+#include <stdlib.h>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+#include "trace.h"
+
+static const byte TRACE_MAGIC[4] = { 'C', '8', 'T', 'R' };
+static const int TRACE_HEADER_SIZE = 4 + 2 + 2 + REG_SIZE;
+
+// Map signed jumps to unsigned varints, small magnitudes to small values.
+static uint32_t zigzag(int value) { return (uint32_t) ((value << 1) ^ (value >> 31)); }
+static int unzigzag(uint32_t value) { return (int) (value >> 1) ^ -(int) (value & 1); }
+
+TraceWriter::TraceWriter() : file_(NULL), closing_(false) {
+    for (int i = 0; i < TRACE_NUM_CHUNKS; i++) {
+        chunks_[i].resize(TRACE_CHUNK_SIZE);
+        sizes_[i] = 0;
+    }
+    chunk_ = 0;
+    out_ = end_ = NULL;
+}
+
+TraceWriter::~TraceWriter() {
+    close();
+}
+
+// The queues keep their indices on separate cache lines, which plain new does
+// not guarantee before C++17, so writers are allocated aligned to a cache line.
+void* TraceWriter::operator new(size_t size) {
+    #if defined(_WIN32)
+    void* pointer = _aligned_malloc(size, CACHE_LINE_SIZE);
+    if (pointer == NULL) {
+        throw std::bad_alloc();
+    }
+    #else
+    void* pointer;
+    if (posix_memalign(&pointer, CACHE_LINE_SIZE, size) != 0) {
+        throw std::bad_alloc();
+    }
+    #endif
+    return pointer;
+}
+
+void TraceWriter::operator delete(void* pointer) {
+    #if defined(_WIN32)
+    _aligned_free(pointer);
+    #else
+    free(pointer);
+    #endif
+}
+
+// Create the trace file and start the writer thread. The registers are those
+// before the first recorded instruction.
+bool TraceWriter::open(const char* path, word pc, word I, const byte* V) {
+    close();
+    file_ = fopen(path, "wb");
+    if (file_ == NULL) {
+        return false;
+    }
+
+    // All chunks but the first are free.
+    int chunk;
+    while (full_.pop(chunk) || free_.pop(chunk)) {}
+    for (int i = 1; i < TRACE_NUM_CHUNKS; i++) {
+        free_.push(i);
+    }
+    chunk_ = 0;
+    out_ = chunks_[0].data();
+    end_ = out_ + TRACE_CHUNK_SIZE - TRACE_MAX_RECORD;
+
+    cycle_ = last_cycle_ = 0;
+    pc_ = pc;
+    I_ = I;
+    memcpy(V_, V, sizeof(V_));
+
+    memcpy(out_, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    out_[4] = pc >> 8;
+    out_[5] = pc & 0xFF;
+    out_[6] = I >> 8;
+    out_[7] = I & 0xFF;
+    memcpy(out_ + 8, V, REG_SIZE);
+    out_ += TRACE_HEADER_SIZE;
+
+    closing_ = false;
+    thread_ = std::thread(&TraceWriter::write_chunks, this);
+    return true;
+}
+
+// Record an instruction which ran at pc, given the program counter, index and
+// registers after it ran.
+void TraceWriter::record(word pc, word opcode, word next_pc, word I, const byte* V) {
+    cycle_++;
+
+    uint32_t mask = I != I_ ? TRACE_INDEX_CHANGED : 0;
+    for (int i = 0; i < REG_SIZE; i++) {
+        mask |= (uint32_t) (V[i] != V_[i]) << i;
+    }
+    if (mask == 0 && next_pc == pc) {
+        return;
+    }
+
+    put_varint(cycle_ - last_cycle_);
+    put_varint(zigzag(pc - pc_));
+    put_varint(zigzag(next_pc - pc - 2));
+    *out_++ = opcode >> 8;
+    *out_++ = opcode & 0xFF;
+    put_varint(mask);
+    for (int i = 0; i < REG_SIZE; i++) {
+        if (mask & (1 << i)) {
+            *out_++ = V_[i] = V[i];
+        }
+    }
+    if (mask & TRACE_INDEX_CHANGED) {
+        put_varint(I_ = I);
+    }
+    last_cycle_ = cycle_;
+    pc_ = next_pc;
+
+    if (out_ >= end_) {
+        submit();
+    }
+}
+
+void TraceWriter::close() {
+    if (file_ == NULL) {
+        return;
+    }
+
+    submit();
+    closing_.store(true, std::memory_order_release);
+    thread_.join();
+    fclose(file_);
+    file_ = NULL;
+}
+
+// Hand the filled part of the current chunk to the writer thread and continue
+// in a free one, waiting for the writer if there is none.
+void TraceWriter::submit() {
+    sizes_[chunk_] = out_ - chunks_[chunk_].data();
+    full_.push(chunk_);
+    while (!free_.pop(chunk_)) {
+        std::this_thread::yield();
+    }
+    out_ = chunks_[chunk_].data();
+    end_ = out_ + TRACE_CHUNK_SIZE - TRACE_MAX_RECORD;
+}
+
+// Write the chunks in order until the writer is closed and all chunks are written.
+void TraceWriter::write_chunks() {
+    while (true) {
+        bool closing = closing_.load(std::memory_order_acquire);
+        int chunk;
+        if (full_.pop(chunk)) {
+            fwrite(chunks_[chunk].data(), 1, sizes_[chunk], file_);
+            free_.push(chunk);
+        } else if (closing) {
+            return;
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+void TraceWriter::put_varint(uint32_t value) {
+    while (value >= 0x80) {
+        *out_++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *out_++ = value;
+}
+
+bool TraceReader::open(const char* path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    data_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if (data_.size() < (size_t) TRACE_HEADER_SIZE ||
+            memcmp(data_.data(), TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        return false;
+    }
+
+    memset(&state_, 0, sizeof(state_));
+    state_.pc = state_.next_pc = data_[4] << 8 | data_[5];
+    state_.I = data_[6] << 8 | data_[7];
+    memcpy(state_.V, data_.data() + 8, REG_SIZE);
+    pos_ = TRACE_HEADER_SIZE;
+    return true;
+}
+
+// Decode the next record, applying its changes to the registers. Returns false
+// at the end of the trace or if the trace is truncated.
+bool TraceReader::next(TraceRecord& record) {
+    uint32_t cycles, moved, jump, mask;
+    if (!get_varint(cycles) || !get_varint(moved) || !get_varint(jump) ||
+            pos_ + 2 > data_.size()) {
+        return false;
+    }
+    word opcode = data_[pos_] << 8 | data_[pos_ + 1];
+    pos_ += 2;
+    if (!get_varint(mask)) {
+        return false;
+    }
+
+    TraceRecord state = state_;
+    state.cycle += cycles;
+    state.pc = state_.next_pc + unzigzag(moved);
+    state.next_pc = state.pc + 2 + unzigzag(jump);
+    state.opcode = opcode;
+    state.mask = mask;
+    for (int i = 0; i < REG_SIZE; i++) {
+        if (mask & (1 << i)) {
+            if (pos_ >= data_.size()) {
+                return false;
+            }
+            state.V[i] = data_[pos_++];
+        }
+    }
+    uint32_t I;
+    if (mask & TRACE_INDEX_CHANGED) {
+        if (!get_varint(I)) {
+            return false;
+        }
+        state.I = I;
+    }
+
+    record = state_ = state;
+    return true;
+}
+
+void TraceReader::get_state(TraceRecord& record) {
+    record = state_;
+}
+
+bool TraceReader::get_varint(uint32_t& value) {
+    value = 0;
+    for (int shift = 0; pos_ < data_.size() && shift < 35; shift += 7) {
+        byte b = data_[pos_++];
+        value |= (uint32_t) (b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,86 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+#include "chip8.h"
+#include "concurrent.h"
+
+const int TRACE_CHUNK_SIZE = 1 << 16;   // Bytes per chunk handed to the writer.
+const int TRACE_NUM_CHUNKS = 8;         // Chunks in the ring buffer.
+const int TRACE_MAX_RECORD = 40;        // Max bytes of an encoded record.
+const uint32_t TRACE_INDEX_CHANGED = 1 << REG_SIZE;     // Mask bit for I.
+
+// An executed instruction together with the registers after it ran.
+struct TraceRecord {
+    long cycle;         // Number of instructions executed, including this one.
+    word pc, opcode;    // Address and opcode of the instruction.
+    word next_pc;       // Address of the instruction which runs next.
+    uint32_t mask;      // Changed registers, V0-VF in bits 0-15, I in bit 16.
+    byte V[REG_SIZE];
+    word I;
+};
+
+// Records the instructions executed by one instance into a file. Records are
+// encoded into chunks of a ring buffer by the emulating thread and written to
+// disk by a thread of the writer, so recording never waits for the disk unless
+// the whole ring is full. The file starts with the registers at the start of the
+// trace; each record holds varints of the cycles since the previous record, of
+// the address relative to the one expected (which only differs when the program
+// counter was changed between instructions, as by a key ending FX0A or loading a
+// state) and of the jump to the next instruction relative to the following
+// address, then the opcode, a varint of the mask of changed registers and their
+// new values. The registers changed between instructions are included in the
+// next record. An instruction which leaves the registers and program counter
+// alone (FX0A waiting for a key, a jump to itself) is not recorded again; the
+// cycles it ran are added to the next record.
+class TraceWriter {
+    public:
+        TraceWriter();
+        ~TraceWriter();
+        static void* operator new(size_t size);     // Cache line aligned.
+        static void operator delete(void* pointer);
+        bool open(const char* path, word pc, word I, const byte* V);
+        void record(word pc, word opcode, word next_pc, word I, const byte* V);
+        void close();                   // Write the buffered records and stop.
+    private:
+        FILE* file_;
+        std::thread thread_;
+        std::atomic<bool> closing_;
+
+        // Ring buffer of chunks, passed to the writer thread when full and back
+        // when written:
+        std::vector<byte> chunks_[TRACE_NUM_CHUNKS];
+        int sizes_[TRACE_NUM_CHUNKS];
+        SpscQueue<int, TRACE_NUM_CHUNKS> full_, free_;
+        int chunk_;                     // Chunk being filled.
+        byte* out_;                     // Next byte to fill.
+        byte* end_;                     // End of the space for whole records.
+
+        // Cycles and registers after the last recorded instruction:
+        long cycle_, last_cycle_;
+        word pc_, I_;                   // pc_ is the expected next address.
+        byte V_[REG_SIZE];
+
+        void submit();                  // Pass the chunk to the writer thread.
+        void write_chunks();            // Body of the writer thread.
+        void put_varint(uint32_t value);
+};
+
+// Reads the records of a trace file one at a time.
+class TraceReader {
+    public:
+        bool open(const char* path);
+        bool next(TraceRecord& record); // Decode the next record, if any.
+        void get_state(TraceRecord& record);    // State after the last record.
+    private:
+        std::vector<byte> data_;
+        size_t pos_;
+        TraceRecord state_;
+
+        bool get_varint(uint32_t& value);
+};
+
+#endif //TRACE_H
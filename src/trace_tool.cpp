@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "chip8.h"
+#include "trace.h"
+
+void print_record(const TraceRecord& record);  // Print an instruction and its changes.
+void print_state(const TraceRecord& state);    // Print the registers.
+
+int main(int argc, char *argv[]) {
+    // Parse command line arguments.
+    if (argc < 2) {
+        printf("Error: missing argument.\n");
+        printf("Usage: ./chip8_trace <path-to-trace> [cycle]\n");
+        return 1;
+    }
+
+    TraceReader reader;
+    if (!reader.open(argv[1])) {
+        printf("Failed to load trace.\n");
+        return 1;
+    }
+
+    // Without a cycle, list all recorded instructions.
+    TraceRecord record;
+    if (argc < 3) {
+        while (reader.next(record)) {
+            print_record(record);
+        }
+        return 0;
+    }
+
+    // Otherwise replay the changes up to and including the cycle.
+    long cycle = atol(argv[2]);
+    TraceRecord state;
+    reader.get_state(state);
+    while (reader.next(record) && record.cycle <= cycle) {
+        state = record;
+    }
+    state.cycle = cycle;
+    print_state(state);
+
+    return 0;
+}
+
+void print_record(const TraceRecord& record) {
+    printf("%10ld  %03X  %04X ", record.cycle, record.pc, record.opcode);
+    for (int i = 0; i < REG_SIZE; i++) {
+        if (record.mask & (1 << i)) {
+            printf(" V%X=0x%02X", i, record.V[i]);
+        }
+    }
+    if (record.mask & TRACE_INDEX_CHANGED) {
+        printf(" I=0x%03X", record.I);
+    }
+    if (record.next_pc != record.pc + 2) {
+        printf(" -> %03X", record.next_pc);
+    }
+    putchar('\n');
+}
+
+void print_state(const TraceRecord& state) {
+    printf("Cycle: %ld\n", state.cycle);
+    printf("PC: 0x%03X I: 0x%03X\n", state.next_pc, state.I);
+    for (int i = 0; i < REG_SIZE; i++) {
+        printf("V%X: 0x%02X%s", i, state.V[i], i % 8 == 7 ? "\n" : " ");
+    }
+}
@@ -1,7 +1,15 @@
 #define UNIT_TEST
 
+#include <thread>
 #include "catch.hpp"
 #include "util.h"
+#include "../src/rewind.h"
+#include "../src/batch.h"
+#include "../src/env.h"
+#include "../src/concurrent.h"
+#include "../src/scheduler.h"
+#include "../src/profile.h"
+#include "../src/trace.h"
 
 TEST_CASE("op_00EE_and_2NNN", "[cpu]") {
     Chip8Test cpu;
@@ -239,6 +247,40 @@ TEST_CASE("op_BNNN", "[cpu]") {
     REQUIRE( cpu.get_pc() == 0xABC );
 }
 
+TEST_CASE("op_CXNN", "[cpu]") {
+    Chip8Test a, b;
+    a.seed(1234);
+    b.seed(1234);
+    for (int i = 0; i < 16; i++) {
+        a.load_opcode(0x200 + 2 * i, 0xC0F0 | (i << 8));
+        b.load_opcode(0x200 + 2 * i, 0xC0F0 | (i << 8));
+    }
+    a.cycle(16);
+    b.cycle(16);
+    for (int i = 0; i < 16; i++) {
+        REQUIRE( a.get_register(i) == b.get_register(i) );
+        REQUIRE( (a.get_register(i) & 0x0F) == 0 );
+    }
+    REQUIRE( a.get_pc() == 0x220 );
+}
+
+TEST_CASE("seed", "[cpu]") {
+    Chip8Test a, b;
+    a.seed(1);
+    b.seed(2);
+    for (int i = 0; i < 16; i++) {
+        a.load_opcode(0x200 + 2 * i, 0xC0FF | (i << 8));
+        b.load_opcode(0x200 + 2 * i, 0xC0FF | (i << 8));
+    }
+    a.cycle(16);
+    b.cycle(16);
+    bool same = true;
+    for (int i = 0; i < 16; i++) {
+        same = same && a.get_register(i) == b.get_register(i);
+    }
+    REQUIRE(!same );
+}
+
 TEST_CASE("op_00E0_and_DXYN", "[cpu]") {
     Chip8Test cpu;
     cpu.load_opcode(0x200, 0xDAB2);
@@ -273,6 +315,52 @@ TEST_CASE("op_00E0_and_DXYN", "[cpu]") {
     REQUIRE( cpu.get_pc() == 0x206 );
 }
 
+TEST_CASE("op_DXYN_wraparound", "[cpu]") {
+    Chip8Test cpu;
+    cpu.load_opcode(0x200, 0xDAB2);
+    cpu.load_register(0xA, 0x7D);
+    cpu.load_register(0xB, 0x3F);
+    cpu.load_memory(0xA00, 0xF1);
+    cpu.load_memory(0xA01, 0x81);
+    cpu.set_index(0xA00);
+    cpu.cycle();
+    REQUIRE( cpu.get_display(61, 31) );
+    REQUIRE( cpu.get_display(63, 31) );
+    REQUIRE( cpu.get_display(0, 31) );
+    REQUIRE(!cpu.get_display(1, 31) );
+    REQUIRE( cpu.get_display(4, 31) );
+    REQUIRE( cpu.get_display(61, 0) );
+    REQUIRE(!cpu.get_display(62, 0) );
+    REQUIRE( cpu.get_display(4, 0) );
+    REQUIRE( cpu.get_register(0xF) == 0 );
+
+    cpu.load_opcode(0x202, 0xDAB1);
+    cpu.load_memory(0xA00, 0x01);
+    cpu.cycle();
+    REQUIRE(!cpu.get_display(4, 31) );
+    REQUIRE( cpu.get_register(0xF) == 1 );
+}
+
+TEST_CASE("dirty_rows", "[cpu]") {
+    Chip8Test cpu;
+    REQUIRE( cpu.get_dirty_rows() == 0xFFFFFFFF );
+    cpu.reset_dirty_rows();
+
+    cpu.load_opcode(0x200, 0xDAB3);
+    cpu.load_register(0xB, 0x1F);
+    cpu.load_memory(0xA00, 0x80);
+    cpu.load_memory(0xA01, 0x00);
+    cpu.load_memory(0xA02, 0x80);
+    cpu.set_index(0xA00);
+    cpu.cycle();
+    REQUIRE( cpu.get_dirty_rows() == 0x80000002 );
+
+    cpu.reset_dirty_rows();
+    cpu.load_opcode(0x202, 0x00E0);
+    cpu.cycle();
+    REQUIRE( cpu.get_dirty_rows() == 0xFFFFFFFF );
+}
+
 TEST_CASE("op_EX9E", "[cpu]") {
     Chip8Test cpu;
     cpu.load_opcode(0x200, 0xEA9E);
@@ -407,3 +495,885 @@ TEST_CASE("op_FX65", "[cpu]") {
     REQUIRE( cpu.get_register(0x2) == 0x00 );
     REQUIRE( cpu.get_pc() == 0x202 );
 }
+
+TEST_CASE("self_modifying_code", "[cpu]") {
+    Chip8Test cpu;
+    cpu.load_opcode(0x200, 0x6A05);
+    cpu.load_opcode(0x202, 0x1200);
+    cpu.cycle();
+    cpu.cycle();
+    REQUIRE( cpu.get_register(0xA) == 0x05 );
+    REQUIRE( cpu.get_pc() == 0x200 );
+
+    // Overwrite 6A05 at 0x200 with 0102 (an invalid operation) using FX55.
+    cpu.load_opcode(0x202, 0xF155);
+    cpu.load_opcode(0x204, 0x1200);
+    cpu.load_register(0x0, 0x01);
+    cpu.load_register(0x1, 0x02);
+    cpu.set_index(0x200);
+    cpu.cycle();
+    cpu.cycle();
+    cpu.cycle();
+    REQUIRE( cpu.get_memory(0x200) == 0x01 );
+    REQUIRE( cpu.get_pc() == 0x200 );
+
+    cpu.load_register(0xA, 0x00);
+    cpu.cycle();
+    REQUIRE( cpu.get_register(0xA) == 0x00 );
+    REQUIRE( cpu.get_pc() == 0x202 );
+}
+
+// Templates of the operations in the generated programs. Operands are filled in
+// randomly; control flow stays within the program and I within memory.
+const word TEMPLATES[] = {
+    0x3000, 0x4000, 0x5000, 0x6000, 0x7000, 0x8000, 0x8001, 0x8002, 0x8003,
+    0x8004, 0x8005, 0x8006, 0x8007, 0x800E, 0x9000, 0xC000, 0xD000, 0xF007,
+    0xF015, 0xF029, 0xF033, 0xF055, 0xF065, 0x00E0, 0x0000
+};
+
+const int NUM_TEMPLATES  = sizeof(TEMPLATES) / sizeof(TEMPLATES[0]);
+const int PROGRAM_LENGTH = 256;
+
+// Generate a random program.
+void build_program(unsigned int seed, std::vector<char>& rom) {
+    srand(seed);
+    rom.clear();
+    for (int i = 0; i < PROGRAM_LENGTH; i++) {
+        word opcode;
+        switch (rand() % 8) {
+            case 0:  opcode = 0x1000 | (0x200 + 2 * (rand() % PROGRAM_LENGTH)); break;
+            case 1:  opcode = 0xA000 | (0x400 + rand() % 0x100);                 break;
+            default: opcode = TEMPLATES[rand() % NUM_TEMPLATES] | (rand() & 0x0FF0);
+        }
+        rom.push_back(opcode >> 8);
+        rom.push_back(opcode & 0xFF);
+    }
+}
+
+// Load a random program into a cpu.
+void load_program(Chip8Test& cpu, const std::vector<char>& rom) {
+    for (size_t i = 0; i < rom.size(); i += 2) {
+        cpu.load_opcode(0x200 + i, (byte) rom[i] << 8 | (byte) rom[i + 1]);
+    }
+}
+
+// Load the same random program into both cpus.
+void load_program(Chip8Test& a, Chip8Test& b, unsigned int seed) {
+    std::vector<char> rom;
+    build_program(seed, rom);
+    load_program(a, rom);
+    load_program(b, rom);
+}
+
+void require_equal(Chip8Test& a, Chip8Test& b) {
+    REQUIRE( a.get_pc() == b.get_pc() );
+    REQUIRE( a.get_index() == b.get_index() );
+    REQUIRE( a.get_delay_timer() == b.get_delay_timer() );
+    for (int i = 0; i < REG_SIZE; i++) {
+        REQUIRE( a.get_register(i) == b.get_register(i) );
+    }
+    for (int i = 0; i < MEM_SIZE; i++) {
+        REQUIRE( a.get_memory(i) == b.get_memory(i) );
+    }
+    for (int x = 0; x < DISPLAY_WIDTH; x++) {
+        for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+            REQUIRE( a.get_display(x, y) == b.get_display(x, y) );
+        }
+    }
+}
+
+TEST_CASE("save_and_load_state", "[cpu]") {
+    Chip8Test cpu;
+    Chip8State state;
+    cpu.load_opcode(0x200, 0xC0FF);
+    cpu.load_opcode(0x202, 0xD015);
+    cpu.load_opcode(0x204, 0x1200);
+    cpu.seed(7);
+    cpu.save_state(state);
+    cpu.cycle(30);
+    byte value = cpu.get_register(0);
+    bool pixel = cpu.get_display(0, 0);
+
+    // Restoring the snapshot replays the same random numbers and drawing.
+    cpu.load_state(state);
+    REQUIRE( cpu.get_pc() == 0x200 );
+    REQUIRE(!cpu.get_display(0, 0) );
+    REQUIRE( cpu.get_dirty_rows() == 0xFFFFFFFF );
+    cpu.cycle(30);
+    REQUIRE( cpu.get_register(0) == value );
+    REQUIRE( cpu.get_display(0, 0) == pixel );
+}
+
+TEST_CASE("load_state_code", "[cpu]") {
+    Chip8Test a, b;
+    Chip8State state;
+    a.load_opcode(0x200, 0x6105);
+    a.load_opcode(0x202, 0x1200);
+    b.load_opcode(0x200, 0x6207);
+    b.load_opcode(0x202, 0x1200);
+    a.cycle(2);
+    b.cycle(2);
+
+    // The operations decoded from the old memory are dropped.
+    b.save_state(state);
+    a.load_state(state);
+    a.cycle(2);
+    REQUIRE( a.get_register(0x1) == 0x00 );
+    REQUIRE( a.get_register(0x2) == 0x07 );
+    REQUIRE( a.get_memory(0x200) == 0x62 );
+}
+
+TEST_CASE("fork", "[cpu]") {
+    Chip8Test parent;
+    parent.load_opcode(0x200, 0x6042);
+    parent.load_opcode(0x202, 0xAA00);
+    parent.load_opcode(0x204, 0xF055);
+    parent.load_opcode(0x206, 0x1206);
+    parent.cycle();
+
+    // The fork continues where the parent was, sharing all of its memory.
+    Chip8Test child(parent);
+    REQUIRE( child.get_pc() == 0x202 );
+    REQUIRE( child.get_register(0x0) == 0x42 );
+    for (int i = 0; i < NUM_PAGES; i++) {
+        REQUIRE( child.is_page_shared(i) );
+    }
+
+    // Only the page written by the child is copied.
+    child.cycle(3);
+    REQUIRE( child.get_memory(0xA00) == 0x42 );
+    REQUIRE( parent.get_memory(0xA00) == 0x00 );
+    REQUIRE(!child.is_page_shared(0xA) );
+    REQUIRE( child.is_page_shared(0x2) );
+
+    // Code written by the parent is not seen by the child.
+    parent.load_opcode(0x202, 0x6107);
+    parent.cycle();
+    REQUIRE( parent.get_register(0x1) == 0x07 );
+    REQUIRE(!parent.is_page_shared(0x2) );
+    REQUIRE( child.get_memory(0x202) == 0xAA );
+}
+
+TEST_CASE("fork_self_modifying_code", "[cpu]") {
+    // FX55 turns the operation at 0x20A into 7109 if V0 is 0x71.
+    Chip8Test parent;
+    parent.load_opcode(0x200, 0x6071);
+    parent.load_opcode(0x202, 0x6105);
+    parent.load_opcode(0x204, 0xA20A);
+    parent.load_opcode(0x206, 0xF055);
+    parent.load_opcode(0x208, 0x120A);
+    parent.load_opcode(0x20A, 0x6109);
+    parent.load_opcode(0x20C, 0x120C);
+    parent.cycle(3);
+
+    // The child modifies its code, the parent writes the original value.
+    Chip8Test child(parent);
+    child.cycle(4);
+    parent.load_register(0x0, 0x61);
+    parent.cycle(4);
+    REQUIRE( child.get_register(0x1) == 0x0E );
+    REQUIRE( parent.get_register(0x1) == 0x09 );
+    REQUIRE(!child.is_page_shared(0x2) );
+}
+
+// Compare the parts of two snapshots which the program can change.
+bool same_state(const Chip8State& a, const Chip8State& b) {
+    return a.pc == b.pc && a.I == b.I && a.random_state == b.random_state &&
+            memcmp(a.V, b.V, sizeof(a.V)) == 0 &&
+            memcmp(a.display, b.display, sizeof(a.display)) == 0 &&
+            memcmp(a.memory, b.memory, sizeof(a.memory)) == 0;
+}
+
+TEST_CASE("rewind", "[rewind]") {
+    // Draw random sprites and write the random numbers to memory.
+    char rom[] = { (char) 0xC0, (char) 0xFF, (char) 0xC1, (char) 0x3F,
+            (char) 0xA3, (char) 0x00, (char) 0xD0, (char) 0x13,
+            (char) 0xF1, (char) 0x55, (char) 0x12, (char) 0x00 };
+    Chip8 cpu;
+    cpu.initialize();
+    cpu.load_rom(rom, sizeof(rom));
+
+    const int num_frames = 50;
+    Chip8State states[num_frames];
+    Rewind history;
+    for (int i = 0; i < num_frames; i++) {
+        cpu.save_state(states[i]);
+        history.record(cpu);
+        cpu.cycle(7);
+        cpu.update_timers();
+    }
+    REQUIRE( history.get_num_frames() == num_frames - 1 );
+
+    Chip8State state;
+    for (int i = num_frames - 2; i >= 0; i--) {
+        REQUIRE( history.rewind(cpu) );
+        cpu.save_state(state);
+        REQUIRE( same_state(state, states[i]) );
+    }
+    REQUIRE(!history.rewind(cpu) );
+    REQUIRE( history.get_size() == 0 );
+}
+
+TEST_CASE("rewind_budget", "[rewind]") {
+    char rom[] = { (char) 0xC0, (char) 0xFF, (char) 0xA3, (char) 0x00,
+            (char) 0xF0, (char) 0x55, (char) 0x70, (char) 0x01, (char) 0x12, (char) 0x00 };
+    Chip8 cpu;
+    cpu.initialize();
+    cpu.load_rom(rom, sizeof(rom));
+
+    // Only the newest frames fit in a small budget.
+    const int num_recorded = 100;
+    Chip8State states[num_recorded];
+    Rewind history(64);
+    for (int i = 0; i < num_recorded; i++) {
+        cpu.save_state(states[i]);
+        history.record(cpu);
+        cpu.cycle(4);
+    }
+    REQUIRE( history.get_num_frames() > 0 );
+    REQUIRE( history.get_num_frames() < num_recorded - 1 );
+    REQUIRE( history.get_size() <= 64 );
+
+    int num_frames = history.get_num_frames();
+    for (int i = 0; i < num_frames; i++) {
+        REQUIRE( history.rewind(cpu) );
+    }
+    Chip8State state;
+    cpu.save_state(state);
+    REQUIRE( same_state(state, states[num_recorded - 1 - num_frames]) );
+    REQUIRE(!history.rewind(cpu) );
+}
+
+// Whether the digit 5 drawn at (5, 3) covers a pixel.
+bool is_digit_pixel(int x, int y) {
+    const byte digit[] = { 0xF0, 0x80, 0xF0, 0x10, 0xF0 };
+    return x >= 5 && x < 13 && y >= 3 && y < 8 && ((digit[y - 3] << (x - 5)) & 0x80);
+}
+
+float register_reward(int, Chip8& cpu, void* data) {
+    return cpu.get_register(*(byte*) data);
+}
+
+bool register_done(int, Chip8& cpu, void* data) {
+    return cpu.get_register(*(byte*) data) >= 20;
+}
+
+TEST_CASE("env_step", "[env]") {
+    // Draw a digit, then count in V2.
+    char rom[] = { 0x60, 0x05, 0x61, 0x03, (char) 0xF0, 0x29, (char) 0xD0, 0x15,
+                   0x72, 0x01, 0x12, 0x08 };
+    const int num_envs = 3;
+    Chip8Env env(num_envs);
+    env.load_rom(rom, sizeof(rom));
+    byte counter = 0x2;
+    env.set_reward_hook(register_reward, &counter);
+    env.set_done_hook(register_done, &counter);
+
+    std::vector<byte> observations(num_envs * OBSERVATION_SIZE, 0xAA);
+    env.reset(&observations[0]);
+    for (int i = 0; i < num_envs * OBSERVATION_SIZE; i++) {
+        REQUIRE( observations[i] == 0 );
+    }
+
+    word actions[num_envs] = { 0 };
+    float rewards[num_envs];
+    bool dones[num_envs];
+    std::vector<byte> copy(num_envs * OBSERVATION_SIZE, 0xAA);
+    for (int step = 1; step <= 7; step++) {
+        // The last step writes to a new buffer, which is written in full.
+        byte* buffer = step < 7 ? &observations[0] : &copy[0];
+        env.step(actions, buffer, rewards, dones);
+        for (int i = 0; i < num_envs; i++) {
+            REQUIRE( rewards[i] == (step < 6 ? 4 * step - 2 : step == 6 ? 22 : 2) );
+            REQUIRE( dones[i] == (step == 6) );
+
+            // The episode which ended was reset, with an empty screen.
+            Chip8& cpu = env.get_cpu(i);
+            for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+                for (int x = 0; x < DISPLAY_WIDTH; x++) {
+                    int pixel = i * OBSERVATION_SIZE + y * DISPLAY_WIDTH + x;
+                    REQUIRE( buffer[pixel] == cpu.is_pixel(x, y) );
+                    REQUIRE( buffer[pixel] == (step == 6 ? 0 : is_digit_pixel(x, y)) );
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("env_actions", "[env]") {
+    // Wait for a key press and store it in V3.
+    char rom[] = { (char) 0xF3, 0x0A, 0x12, 0x02 };
+    Chip8Env env(2);
+    env.load_rom(rom, sizeof(rom));
+
+    std::vector<byte> observations(2 * OBSERVATION_SIZE);
+    env.reset(&observations[0]);
+    word actions[2] = { 0, 1 << 0xB };
+    float rewards[2];
+    bool dones[2];
+    env.step(actions, &observations[0], rewards, dones);
+    REQUIRE( env.get_cpu(0).get_pc() == 0x200 );
+    REQUIRE( env.get_cpu(1).get_register(0x3) == 0xB );
+    REQUIRE( env.get_cpu(1).get_pc() == 0x202 );
+}
+
+TEST_CASE("scheduler", "[scheduler]") {
+    // Store the delay timer in V1 in a loop.
+    char rom[] = { 0x60, (char) 0xFF, (char) 0xF0, 0x15, (char) 0xF1, 0x07, 0x12, 0x04 };
+    Chip8 cpu;
+    cpu.initialize();
+    cpu.load_rom(rom, sizeof(rom));
+
+    // 500 cycles per second are 8 1/3 cycles per tick.
+    Scheduler scheduler(500);
+    scheduler.run_ticks(cpu, 3);
+    REQUIRE( scheduler.get_cycles() == 25 );
+    scheduler.run_ticks(cpu, 57);
+    REQUIRE( scheduler.get_cycles() == 500 );
+    REQUIRE( scheduler.get_ticks() == 60 );
+    REQUIRE( cpu.get_register(0x1) == 0xFF - 59 );
+
+    // The ticks within or at the end of the cycles run are run too.
+    scheduler.run(cpu, 1000);
+    REQUIRE( scheduler.get_cycles() == 1500 );
+    REQUIRE( scheduler.get_ticks() == 180 );
+    scheduler.run(cpu, 7);
+    REQUIRE( scheduler.get_ticks() == 180 );
+    scheduler.run(cpu, 1);
+    REQUIRE( scheduler.get_ticks() == 181 );
+
+    // Fewer cycles than ticks per second.
+    Scheduler slow(50);
+    slow.run_ticks(cpu, 6);
+    REQUIRE( slow.get_cycles() == 5 );
+    slow.set_speed(120);
+    slow.run_ticks(cpu, 6);
+    REQUIRE( slow.get_cycles() == 17 );
+}
+
+TEST_CASE("scheduler_clock", "[scheduler]") {
+    Scheduler scheduler;
+    scheduler.start_clock();
+    std::this_thread::sleep_until(scheduler.get_next_tick_time());
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    REQUIRE( scheduler.poll() >= 1 );
+
+    // Ticks missed for a long time are dropped.
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    REQUIRE( scheduler.poll() == MAX_TICKS_BEHIND );
+    REQUIRE( scheduler.poll() == 0 );
+}
+
+TEST_CASE("triple_buffer", "[concurrent]") {
+    TripleBuffer<int> buffer;
+    REQUIRE( !buffer.update() );
+
+    // Only the newest published value is taken.
+    buffer.get_back() = 1;
+    buffer.publish();
+    buffer.get_back() = 2;
+    buffer.publish();
+    REQUIRE( buffer.update() );
+    REQUIRE( buffer.get_front() == 2 );
+    REQUIRE( !buffer.update() );
+    REQUIRE( buffer.get_front() == 2 );
+
+    // Values arrive in order and intact from another thread.
+    const int num_values = 100000;
+    TripleBuffer<std::pair<int, int> > pairs;
+    std::thread producer([&pairs]() {
+        for (int i = 1; i <= num_values; i++) {
+            pairs.get_back() = std::make_pair(i, -i);
+            pairs.publish();
+        }
+    });
+    int last = 0;
+    bool intact = true, ordered = true;
+    while (last < num_values) {
+        if (pairs.update()) {
+            intact = intact && pairs.get_front().second == -pairs.get_front().first;
+            ordered = ordered && pairs.get_front().first > last;
+            last = pairs.get_front().first;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    REQUIRE( intact );
+    REQUIRE( ordered );
+}
+
+TEST_CASE("spsc_queue", "[concurrent]") {
+    SpscQueue<int, 4> queue;
+    int value;
+    REQUIRE( !queue.pop(value) );
+    for (int i = 0; i < 4; i++) {
+        REQUIRE( queue.push(i) );
+    }
+    REQUIRE( !queue.push(4) );
+    REQUIRE( queue.pop(value) );
+    REQUIRE( value == 0 );
+
+    // Every value arrives once and in order from another thread.
+    const int num_values = 100000;
+    SpscQueue<int, 64> values;
+    std::thread producer([&values]() {
+        for (int i = 0; i < num_values; i++) {
+            while (!values.push(i)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+    int expected = 0;
+    bool ordered = true;
+    while (expected < num_values) {
+        if (values.pop(value)) {
+            ordered = ordered && value == expected;
+            expected++;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    REQUIRE( ordered );
+    REQUIRE( !values.pop(value) );
+}
+
+TEST_CASE("trace", "[trace]") {
+    const char* path = "test_trace.c8t";
+    byte V[REG_SIZE] = { 0 };
+    TraceWriter writer;
+    REQUIRE( writer.open(path, 0x200, 0, V) );
+
+    V[0] = 5;
+    writer.record(0x200, 0x6005, 0x202, 0, V);
+
+    // FX0A waits without changes, then a key press sets V1 and moves on.
+    writer.record(0x202, 0xF10A, 0x202, 0, V);
+    writer.record(0x202, 0xF10A, 0x202, 0, V);
+    V[1] = 7;
+    writer.record(0x204, 0xA300, 0x206, 0x300, V);
+    writer.record(0x206, 0x1200, 0x200, 0x300, V);
+
+    // Enough records to fill several chunks.
+    for (int i = 0; i < 20000; i++) {
+        V[2] = i;
+        writer.record(0x200 + 2 * (i % 4), 0x7201, 0x202 + 2 * (i % 4), 0x300, V);
+    }
+    writer.close();
+
+    TraceReader reader;
+    TraceRecord record;
+    REQUIRE( reader.open(path) );
+    REQUIRE( reader.next(record) );
+    REQUIRE( record.cycle == 1 );
+    REQUIRE( record.pc == 0x200 );
+    REQUIRE( record.opcode == 0x6005 );
+    REQUIRE( record.mask == 0x1 );
+    REQUIRE( record.V[0] == 5 );
+
+    REQUIRE( reader.next(record) );
+    REQUIRE( record.cycle == 4 );
+    REQUIRE( record.pc == 0x204 );
+    REQUIRE( record.mask == (0x2 | TRACE_INDEX_CHANGED) );
+    REQUIRE( record.V[1] == 7 );
+    REQUIRE( record.I == 0x300 );
+
+    REQUIRE( reader.next(record) );
+    REQUIRE( record.cycle == 5 );
+    REQUIRE( record.next_pc == 0x200 );
+    REQUIRE( record.mask == 0 );
+
+    bool ordered = true;
+    for (int i = 0; i < 20000; i++) {
+        ordered = ordered && reader.next(record) && record.cycle == 6 + i &&
+                record.pc == 0x200 + 2 * (i % 4) && record.V[2] == (byte) i &&
+                record.V[0] == 5 && record.I == 0x300;
+    }
+    REQUIRE( ordered );
+    REQUIRE( !reader.next(record) );
+    remove(path);
+}
+
+#if defined(CHIP8_TRACE)
+TEST_CASE("trace_cpu", "[trace]") {
+    const char* path = "test_trace_cpu.c8t";
+    std::vector<char> rom;
+    build_program(7, rom);
+
+    Chip8 cpu;
+    cpu.initialize();
+    cpu.load_rom(rom.data(), rom.size());
+    REQUIRE( cpu.start_trace(path) );
+    for (int frame = 0; frame < 100; frame++) {
+        cpu.cycle(1 + frame % 23);
+        cpu.update_timers();
+    }
+    cpu.stop_trace();
+
+    // Replaying all changes ends in the state of the cpu.
+    TraceReader reader;
+    TraceRecord state;
+    REQUIRE( reader.open(path) );
+    while (reader.next(state)) {}
+    REQUIRE( state.next_pc == cpu.get_pc() );
+    REQUIRE( state.I == cpu.get_index() );
+    for (int i = 0; i < REG_SIZE; i++) {
+        REQUIRE( state.V[i] == cpu.get_register(i) );
+    }
+    remove(path);
+}
+#endif
+
+TEST_CASE("profile", "[profile]") {
+    char rom[] = { 0x60, 0x05, (char) 0xF1, 0x0A, 0x12, 0x04 };
+    Chip8 cpu;
+    cpu.initialize();
+    cpu.load_rom(rom, sizeof(rom));
+    REQUIRE( cpu.get_profile() == NULL );
+    cpu.set_profiling(true);
+
+    // 6005 runs once, then FX0A waits until a key is pressed.
+    cpu.cycle(10);
+    cpu.set_key(3, true);
+    cpu.cycle(5);
+
+    const Profile* profile = cpu.get_profile();
+    REQUIRE( profile != NULL );
+    REQUIRE( profile->cycles == 15 );
+    REQUIRE( profile->ops[OP_ASSIGN_CONST] == 1 );
+    REQUIRE( profile->ops[OP_GET_KEY] == 9 );
+    REQUIRE( profile->ops[OP_JUMP] == 5 );
+    REQUIRE( profile->pcs[0x200] == 1 );
+    REQUIRE( profile->pcs[0x202] == 9 );
+    REQUIRE( profile->pcs[0x204] == 5 );
+    REQUIRE( profile->key_wait_cycles == 9 );
+    REQUIRE( !profile->waiting );
+
+    cpu.set_profiling(false);
+    REQUIRE( cpu.get_profile() == NULL );
+}
+
+// A program setting the delay timer to a random number and polling it until zero.
+const word DELAY_LOOP[] = { 0xCA07, 0xFA15, 0xF107, 0x3100, 0x1204, 0x7201, 0x1200 };
+
+TEST_CASE("idle_delay_loop", "[cpu]") {
+    // Skipping the rounds of the loop ends in the same state as running them.
+    Chip8Test fast, slow;
+    for (int i = 0; i < 7; i++) {
+        fast.load_opcode(0x200 + 2 * i, DELAY_LOOP[i]);
+        slow.load_opcode(0x200 + 2 * i, DELAY_LOOP[i]);
+    }
+    for (int frame = 0; frame < 100; frame++) {
+        int num_cycles = 1 + frame % 23 * 7;
+        fast.cycle(num_cycles);
+        for (int i = 0; i < num_cycles; i++) {
+            slow.cycle();
+        }
+        require_equal(fast, slow);
+        fast.update_timers();
+        slow.update_timers();
+    }
+    REQUIRE( fast.get_register(0x2) > 0 );
+    REQUIRE( fast.get_idle_cycles() > 0 );
+    REQUIRE( slow.get_idle_cycles() == 0 );
+}
+
+TEST_CASE("halt_FX0A", "[cpu]") {
+    Chip8Test cpu;
+    cpu.load_opcode(0x200, 0xF30A);
+    cpu.load_opcode(0x202, 0x6101);
+    REQUIRE( !cpu.cycle(1000) );
+    REQUIRE( cpu.get_pc() == 0x200 );
+    REQUIRE( cpu.get_idle_cycles() == 999 );
+    REQUIRE( cpu.is_halted() );
+
+    // The timers still run while waiting.
+    cpu.set_delay_timer(2);
+    REQUIRE( !cpu.is_halted() );
+    cpu.update_timers();
+    cpu.update_timers();
+    REQUIRE( cpu.is_halted() );
+
+    cpu.set_key(0x7, true);
+    REQUIRE( !cpu.is_halted() );
+    REQUIRE( cpu.cycle() );
+    REQUIRE( cpu.get_register(0x3) == 0x7 );
+    REQUIRE( cpu.get_register(0x1) == 0x1 );
+}
+
+TEST_CASE("idle_jump", "[cpu]") {
+    Chip8Test cpu;
+    cpu.load_opcode(0x200, 0x1200);
+    cpu.cycle(1000);
+    REQUIRE( cpu.get_pc() == 0x200 );
+    REQUIRE( cpu.get_idle_cycles() == 999 );
+
+    // The JIT counts its cycles itself and runs idle loops like any other code.
+    Chip8Test jit;
+    if (jit.set_engine(ENGINE_JIT)) {
+        jit.load_opcode(0x200, 0x1200);
+        jit.cycle(1000);
+        REQUIRE( jit.get_pc() == 0x200 );
+        REQUIRE( jit.get_idle_cycles() == 0 );
+    }
+}
+
+TEST_CASE("fused_decode", "[cpu]") {
+    Chip8Test cpu;
+    cpu.load_opcode(0x200, 0xA20A);
+    cpu.load_opcode(0x202, 0xD015);
+    REQUIRE( cpu.get_fused(0x200) == Chip8Test::get_fusion(OP_SET_INDEX, OP_DRAW) );
+    REQUIRE( cpu.get_fused(0x200) != 0 );
+
+    // Rewriting the next operation, in part or across a page, decodes the pair again.
+    cpu.load_memory(0x202, 0x60);
+    REQUIRE( cpu.get_fused(0x200) == Chip8Test::get_fusion(OP_SET_INDEX, OP_ASSIGN_CONST) );
+    cpu.load_opcode(0x2FE, 0xA20A);
+    cpu.load_opcode(0x300, 0xD015);
+    REQUIRE( cpu.get_fused(0x2FE) == Chip8Test::get_fusion(OP_SET_INDEX, OP_DRAW) );
+    cpu.load_opcode(0x300, 0x00EE);
+    REQUIRE( cpu.get_fused(0x2FE) == Chip8Test::get_fusion(OP_SET_INDEX, OP_RET) );
+
+    // Instructions which may not continue with the next operation are never fused.
+    for (int first = 0; first < NUM_OPS; first++) {
+        for (int second = 0; second < NUM_OPS; second++) {
+            REQUIRE( (Chip8Test::get_fusion(first, second) == 0 || Chip8::can_fuse(first)) );
+        }
+    }
+}
+
+TEST_CASE("fused_random_programs", "[cpu]") {
+    Chip8Test fused, stepped;
+    for (unsigned int seed = 1; seed <= 32; seed++) {
+        fused.initialize();
+        stepped.initialize();
+        fused.seed(seed);
+        stepped.seed(seed);
+        load_program(fused, stepped, seed);
+
+        // A single cycle never runs a fused pair.
+        for (int frame = 0; frame < 200; frame++) {
+            int num_cycles = 1 + frame % 37;
+            fused.cycle(num_cycles);
+            for (int i = 0; i < num_cycles; i++) {
+                stepped.cycle(1);
+            }
+            fused.update_timers();
+            stepped.update_timers();
+        }
+        require_equal(fused, stepped);
+    }
+}
+
+TEST_CASE("batch_idle_delay_loop", "[batch]") {
+    const int num_lanes = 16;
+    std::vector<char> rom;
+    for (int i = 0; i < 7; i++) {
+        rom.push_back(DELAY_LOOP[i] >> 8);
+        rom.push_back(DELAY_LOOP[i] & 0xFF);
+    }
+
+    Chip8Batch batch(num_lanes);
+    std::vector<Chip8Test> lanes(num_lanes);
+    batch.load_rom(rom.data(), rom.size());
+    for (int i = 0; i < num_lanes; i++) {
+        batch.seed(i, i);
+        lanes[i].seed(i);
+        load_program(lanes[i], rom);
+    }
+
+    for (int frame = 0; frame < 100; frame++) {
+        int num_cycles = 1 + frame % 23 * 7;
+        batch.cycle(num_cycles);
+        batch.update_timers();
+        for (int i = 0; i < num_lanes; i++) {
+            for (int j = 0; j < num_cycles; j++) {
+                lanes[i].cycle();
+            }
+            lanes[i].update_timers();
+        }
+    }
+
+    Chip8State a, b;
+    for (int i = 0; i < num_lanes; i++) {
+        batch.save_state(i, a);
+        lanes[i].save_state(b);
+        REQUIRE( same_state(a, b) );
+        REQUIRE( a.delay_timer == b.delay_timer );
+    }
+}
+
+TEST_CASE("batch_random_programs", "[batch]") {
+    const int num_lanes = 37;
+    for (unsigned int seed = 1; seed <= 8; seed++) {
+        std::vector<char> rom;
+        build_program(seed, rom);
+
+        // Each lane draws different random numbers, so the lanes diverge.
+        Chip8Batch batch(num_lanes);
+        std::vector<Chip8Test> lanes(num_lanes);
+        batch.load_rom(rom.data(), rom.size());
+        for (int i = 0; i < num_lanes; i++) {
+            batch.seed(i, seed * num_lanes + i);
+            lanes[i].seed(seed * num_lanes + i);
+            load_program(lanes[i], rom);
+        }
+
+        for (int frame = 0; frame < 100; frame++) {
+            int num_cycles = 1 + frame % 23;
+            batch.cycle(num_cycles);
+            batch.update_timers();
+            for (int i = 0; i < num_lanes; i++) {
+                lanes[i].cycle(num_cycles);
+                lanes[i].update_timers();
+            }
+        }
+
+        Chip8State a, b;
+        for (int i = 0; i < num_lanes; i++) {
+            batch.save_state(i, a);
+            lanes[i].save_state(b);
+            REQUIRE( same_state(a, b) );
+            REQUIRE( a.delay_timer == b.delay_timer );
+        }
+    }
+}
+
+TEST_CASE("threaded_random_programs", "[threaded]") {
+    Chip8Test interpreter, threaded;
+    if (!interpreter.set_engine(ENGINE_INTERPRETER) || !threaded.set_engine(ENGINE_THREADED)) {
+        return;
+    }
+
+    for (unsigned int seed = 1; seed <= 32; seed++) {
+        interpreter.initialize();
+        threaded.initialize();
+        interpreter.seed(seed);
+        threaded.seed(seed);
+        load_program(interpreter, threaded, seed);
+
+        for (int frame = 0; frame < 200; frame++) {
+            int num_cycles = 1 + frame % 37;
+            REQUIRE( interpreter.cycle(num_cycles) == threaded.cycle(num_cycles) );
+            interpreter.update_timers();
+            threaded.update_timers();
+        }
+        require_equal(interpreter, threaded);
+        REQUIRE( interpreter.get_idle_cycles() == threaded.get_idle_cycles() );
+    }
+}
+
+TEST_CASE("jit_random_programs", "[jit]") {
+    Chip8Test interpreter, jit;
+    if (!jit.set_engine(ENGINE_JIT)) {
+        return;
+    }
+
+    for (unsigned int seed = 1; seed <= 32; seed++) {
+        interpreter.initialize();
+        jit.initialize();
+        interpreter.seed(seed);
+        jit.seed(seed);
+        load_program(interpreter, jit, seed);
+
+        // Run both engines with uneven budgets so blocks are split up.
+        for (int frame = 0; frame < 200; frame++) {
+            int num_cycles = 1 + frame % 37;
+            interpreter.cycle(num_cycles);
+            jit.cycle(num_cycles);
+            interpreter.update_timers();
+            jit.update_timers();
+        }
+        require_equal(interpreter, jit);
+    }
+}
+
+TEST_CASE("jit_flags", "[jit]") {
+    Chip8Test cpu;
+    if (!cpu.set_engine(ENGINE_JIT)) {
+        return;
+    }
+
+    // Each operation is followed by a jump, so it is translated into a block of
+    // its own, which runs as native code when the budget covers the whole block.
+    cpu.load_opcode(0x200, 0x8AB4);
+    cpu.load_opcode(0x202, 0x1204);
+    cpu.load_opcode(0x204, 0x8CD5);
+    cpu.load_opcode(0x206, 0x1208);
+    cpu.load_opcode(0x208, 0x8EF7);
+    cpu.load_opcode(0x20A, 0x120C);
+    cpu.load_opcode(0x20C, 0x8F0E);
+    cpu.load_opcode(0x20E, 0x1210);
+    cpu.load_opcode(0x210, 0x1210);
+    cpu.load_register(0xA, 0xFF);
+    cpu.load_register(0xB, 0x02);
+    cpu.load_register(0xC, 0x01);
+    cpu.load_register(0xD, 0x02);
+    cpu.cycle(2);
+    REQUIRE( cpu.get_jit_blocks_run() == 1 );
+    REQUIRE( cpu.get_register(0xA) == 0x01 );
+    REQUIRE( cpu.get_register(0xF) == 0x01 );
+
+    cpu.cycle(2);
+    REQUIRE( cpu.get_jit_blocks_run() == 2 );
+    REQUIRE( cpu.get_register(0xC) == 0xFF );
+    REQUIRE( cpu.get_register(0xF) == 0x00 );
+
+    // 8EF7 reads VF as its operand.
+    cpu.load_register(0xE, 0x05);
+    cpu.cycle(2);
+    REQUIRE( cpu.get_jit_blocks_run() == 3 );
+    REQUIRE( cpu.get_register(0xE) == 0xFB );
+    REQUIRE( cpu.get_register(0xF) == 0x00 );
+
+    // 8F0E shifts VF itself: the flag is stored first, so the result remains.
+    cpu.load_register(0xF, 0x81);
+    cpu.cycle(2);
+    REQUIRE( cpu.get_jit_blocks_run() == 4 );
+    REQUIRE( cpu.get_register(0xF) == 0x02 );
+    REQUIRE( cpu.get_pc() == 0x210 );
+}
+
+TEST_CASE("jit_wrapping_write", "[jit]") {
+    Chip8Test cpu;
+    if (!cpu.set_engine(ENGINE_JIT)) {
+        return;
+    }
+
+    // A subroutine at 0x000 is compiled, then rewritten by FX55 wrapping around
+    // the end of memory, and called again.
+    cpu.load_opcode(0x000, 0x6A01);
+    cpu.load_opcode(0x002, 0x00EE);
+    cpu.load_opcode(0x200, 0x2000);
+    cpu.load_opcode(0x202, 0xAFFE);
+    cpu.load_opcode(0x204, 0x626A);
+    cpu.load_opcode(0x206, 0x6307);
+    cpu.load_opcode(0x208, 0xF355);
+    cpu.load_opcode(0x20A, 0x2000);
+    cpu.load_opcode(0x20C, 0x120C);
+    cpu.cycle(100);
+    REQUIRE( cpu.get_jit_blocks_run() > 0 );
+    REQUIRE( cpu.get_memory(0x001) == 0x07 );
+    REQUIRE( cpu.get_register(0xA) == 0x07 );
+}
+
+TEST_CASE("jit_FX0A", "[jit]") {
+    Chip8Test cpu;
+    if (!cpu.set_engine(ENGINE_JIT)) {
+        return;
+    }
+
+    cpu.load_opcode(0x200, 0x6101);
+    cpu.load_opcode(0x202, 0xFA0A);
+    cpu.load_opcode(0x204, 0x6102);
+    cpu.cycle(10);
+    REQUIRE( cpu.get_register(0x1) == 0x01 );
+    REQUIRE( cpu.get_pc() == 0x202 );
+
+    cpu.set_key(0x05, true);
+    REQUIRE( cpu.get_register(0xA) == 0x05 );
+    cpu.cycle();
+    REQUIRE( cpu.get_register(0x1) == 0x02 );
+    REQUIRE( cpu.get_pc() == 0x206 );
+}
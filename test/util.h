@@ -2,13 +2,21 @@
 #define CHIP8TEST_H
 
 #include "../src/chip8.h"
+#include "../src/jit.h"
 
 class Chip8Test {
     public:
         Chip8Test();
+        Chip8Test(const Chip8Test& other);
         ~Chip8Test();
         void initialize();
-        void cycle();
+        bool set_engine(Engine engine);
+        void seed(uint64_t value);
+        void save_state(Chip8State& state);
+        void load_state(const Chip8State& state);
+        bool cycle(int num_cycles = 1);
+        bool is_halted();
+        void update_timers();
         void set_index(word address);
         void set_delay_timer(byte value);
         void set_key(byte index, bool value);
@@ -24,23 +32,51 @@ class Chip8Test {
         byte get_memory(word address);
         byte get_register(byte index);
         bool get_display(int x, int y);
+        uint32_t get_dirty_rows();
+        void reset_dirty_rows();
+        bool is_page_shared(int index);
+        uint64_t get_idle_cycles();
+        uint64_t get_jit_blocks_run();
+        byte get_fused(word address);
+        static byte get_fusion(byte first, byte second);
     private:
         Chip8* cpu_;
 };
 
-Chip8Test::Chip8Test()  { cpu_ = new Chip8(); cpu_->initialize(); }
+// The engine of the cpus under test can be selected with the CHIP8_ENGINE
+// environment variable, so the tests run against each interpreter.
+Chip8Test::Chip8Test() {
+    cpu_ = new Chip8();
+    const char* engine = getenv("CHIP8_ENGINE");
+    if (engine != NULL && strcmp(engine, "threaded") == 0) {
+        cpu_->set_engine(ENGINE_THREADED);
+    }
+    cpu_->initialize();
+}
+
+Chip8Test::Chip8Test(const Chip8Test& other) { cpu_ = new Chip8(*other.cpu_); }
 Chip8Test::~Chip8Test() { delete cpu_;   }
-void Chip8Test::cycle() { cpu_->cycle(); }
+void Chip8Test::initialize() { cpu_->initialize(); }
+void Chip8Test::update_timers() { cpu_->update_timers(); }
+bool Chip8Test::cycle(int num_cycles) { return cpu_->cycle(num_cycles); }
+bool Chip8Test::is_halted() { return cpu_->is_halted(); }
+bool Chip8Test::set_engine(Engine engine) { return cpu_->set_engine(engine); }
+void Chip8Test::seed(uint64_t value) { cpu_->seed(value); }
+void Chip8Test::save_state(Chip8State& state) { cpu_->save_state(state); }
+void Chip8Test::load_state(const Chip8State& state) { cpu_->load_state(state); }
 
 void Chip8Test::set_index(word address)             { cpu_->I_ = address;           }
 void Chip8Test::set_delay_timer(byte value)         { cpu_->delay_timer_ = value;   }
 void Chip8Test::set_key(byte index, bool value)     { cpu_->set_key(index, value);  }
 void Chip8Test::load_register(byte index, byte val) { cpu_->V_[index] = val;        }
-void Chip8Test::load_memory(word address, byte val) { cpu_->memory_[address] = val; }
+
+void Chip8Test::load_memory(word address, byte val) {
+    cpu_->write(address, &val, 1);
+}
 
 void Chip8Test::load_opcode(word address, word opcode) {
-    cpu_->memory_[address] = (opcode & 0xFF00) >> 8;
-    cpu_->memory_[address + 1] = opcode & 0x00FF;
+    byte data[2] = { (byte) ((opcode & 0xFF00) >> 8), (byte) (opcode & 0x00FF) };
+    cpu_->write(address, data, 2);
 }
 
 word Chip8Test::get_pc()                  { return cpu_->pc_;              }
@@ -49,8 +85,21 @@ word Chip8Test::get_index()               { return cpu_->I_;               }
 byte Chip8Test::get_delay_timer()         { return cpu_->delay_timer_;     }
 byte Chip8Test::get_sound_timer()         { return cpu_->sound_timer_;     }
 word Chip8Test::get_stack(byte index)     { return cpu_->stack_[index];    }
-byte Chip8Test::get_memory(word address)  { return cpu_->memory_[address]; }
+byte Chip8Test::get_memory(word address)  { return cpu_->read(address);    }
 byte Chip8Test::get_register(byte index)  { return cpu_->V_[index];        }
-bool Chip8Test::get_display(int x, int y) { return cpu_->display_[x][y];   }
+bool Chip8Test::get_display(int x, int y) { return cpu_->is_pixel(x, y);  }
+uint32_t Chip8Test::get_dirty_rows()      { return cpu_->get_dirty_rows(); }
+void Chip8Test::reset_dirty_rows()        { cpu_->reset_dirty_rows();      }
+bool Chip8Test::is_page_shared(int index) { return cpu_->pages_[index]->refs > 1; }
+uint64_t Chip8Test::get_idle_cycles()     { return cpu_->get_idle_cycles(); }
+uint64_t Chip8Test::get_jit_blocks_run() {
+    return cpu_->jit_ != NULL ? cpu_->jit_->get_blocks_run() : 0;
+}
+byte Chip8Test::get_fused(word address)   { return cpu_->operation(address).fused; }
+
+// The fused handler of a pair of instructions, 0 if the pair is not fused.
+byte Chip8Test::get_fusion(byte first, byte second) {
+    return Chip8::fusions_[first][second];
+}
 
 #endif //CHIP8TEST_H